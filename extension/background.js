@@ -10,6 +10,7 @@ const unix = {
   ENXIO: 6,
   ENOTSUP: 45,
   ETIMEDOUT: 110, // FIXME: not on macOS (?)
+  ESTALE: 116, // FIXME: not on macOS (70)
 
   // Unix file types
   S_IFMT: 0170000, // type of file mask
@@ -25,6 +26,10 @@ class UnixError extends Error {
   constructor(error) { super(); this.name = "UnixError"; this.error = error; }
 }
 
+// Called when tabfs goes away, and with it every handle it had open,
+// whether or not we ever hear their releases.
+const disconnectListeners = [];
+
 const sanitize = (function() {
   // from https://github.com/parshap/node-sanitize-filename/blob/209c39b914c8eb48ee27bcbde64b2c7822fdf3de/index.js
 
@@ -81,6 +86,41 @@ const utf8ArrayToBase64 = async (data) => {
     return base64url.split(",", 2)[1]
 };
 
+// File contents that we already have as base64 (like a screenshot
+// data URL), so there's no point decoding them just so onMessage can
+// encode each read() right back. Looks enough like a Uint8Array
+// (length, slice) for makeRouteWithContents, but slice() gives you
+// `{base64: [...]}`, strings that each decode on their own and that
+// onMessage sends as-is: bytes that don't start or end on a 3-byte
+// group get re-encoded by themselves, and everything in between is
+// just a substring.
+class Base64Contents {
+  constructor(base64) {
+    this.base64 = base64;
+    const padding = base64.endsWith('==') ? 2 : base64.endsWith('=') ? 1 : 0;
+    this.length = base64.length / 4 * 3 - padding;
+  }
+  // bytes [start, end), which all have to be in the same group
+  group(start, end) {
+    const group = atob(this.base64.substr(Math.floor(start / 3) * 4, 4));
+    return btoa(group.substr(start % 3, end - start));
+  }
+  slice(start, end = this.length) {
+    start = Math.max(0, start); end = Math.min(end, this.length);
+    const parts = [];
+    if (start < end && start % 3) {
+      const groupEnd = Math.min(end, start - start % 3 + 3);
+      parts.push(this.group(start, groupEnd)); start = groupEnd;
+    }
+    const alignedEnd = end - end % 3;
+    if (start < alignedEnd) {
+      parts.push(this.base64.substring(start / 3 * 4, alignedEnd / 3 * 4)); start = alignedEnd;
+    }
+    if (start < end) { parts.push(this.group(start, end)); }
+    return { base64: parts };
+  }
+}
+
 // global so it can be hot-reloaded
 window.Routes = {};
 
@@ -96,62 +136,276 @@ const makeRouteWithContents = (function() {
     // individual chunk read() and write() requests without doing a
     // whole new conversation with the browser and regenerating the
     // content -- important for taking a screenshot, for instance)
-    store: {}, nextHandle: 0,
+    //
+    // Handles that opened the same contents share one buffer until one
+    // of them writes (then it gets its own copy). What we hold is
+    // capped at `budget` bytes: past that, the least recently used
+    // clean handles let go of their contents and go back to getData if
+    // they get read again. Same for handles nobody's touched in
+    // `idleMs`, and ones idle `abandonMs` (probably lost their release)
+    // get dropped altogether. Dirty handles stay put, since that's
+    // someone's unsaved write.
+    //
+    // Handles count up from when the extension started, so ones tabfs
+    // still has from before a reload (it stays mounted, in daemon
+    // mode) can't be mistaken for new ones: those, we've never heard
+    // of, and they get ESTALE.
+    store: new Map(), // handle -> {path, object, owned, dirty, stale, lastUsed}
+    byPath: new Map(), // path -> Set of handles
+    refs: new Map(), // contents -> how many handles have it
+    reclaimed: new Map(), // handle -> path, for handles we dropped (clean ones only)
+    bytes: 0, nextHandle: Math.floor(Date.now() / 1000) * 2 ** 21,
+    budget: 64 * 1024 * 1024, idleMs: 60 * 1000, abandonMs: 60 * 60 * 1000,
+    stats: { hits: 0, reloads: 0, evictions: 0, reclaimed: 0 },
+
+    hold(object) {
+      const n = this.refs.get(object) || 0;
+      this.refs.set(object, n + 1);
+      if (n === 0) { this.bytes += object.length; }
+    },
+    letGo(object) {
+      if (!object) { return; }
+      const n = this.refs.get(object);
+      if (n > 1) { this.refs.set(object, n - 1); return; }
+      this.refs.delete(object);
+      this.bytes -= object.length;
+    },
+    set(stored, object, owned) {
+      this.letGo(stored.object);
+      stored.object = object; stored.owned = owned;
+      if (object) { this.hold(object); }
+    },
+
     storeObject(path, object) {
       const handle = ++this.nextHandle;
-      this.store[handle] = {path, object};
+      const stored = {path, object: null, owned: false, dirty: false, lastUsed: Date.now()};
+      this.set(stored, object, false);
+      this.store.set(handle, stored);
+      if (!this.byPath.has(path)) { this.byPath.set(path, new Set()); }
+      this.byPath.get(path).add(handle);
+      this.evict();
+      this.startSweeping();
       return handle;
     },
-    getObjectForHandle(handle) { return this.store[handle].object; },
-    setObjectForHandle(handle, object) { this.store[handle].object = object; },
-    removeObjectForHandle(handle) { delete this.store[handle]; },
+    // The handle's contents; load() gets them again if we let go of
+    // them (or dropped the handle altogether, in a reclaim), or if
+    // they went stale and you're reading from the top again.
+    async getObjectForHandle(req, load) {
+      let stored = this.store.get(req.fh);
+      if (!stored && this.reclaimed.get(req.fh) !== req.path) { throw new UnixError(unix.ESTALE); }
+      if (stored && stored.stale && req.offset === 0 && !stored.dirty) {
+        stored.stale = false;
+        this.set(stored, null, false);
+      }
+      if (stored && stored.object) {
+        this.stats.hits++;
+        stored.lastUsed = Date.now();
+        return stored.object;
+      }
+      this.stats.reloads++;
+      const object = await load();
+      stored = this.store.get(req.fh);
+      if (!stored) {
+        if (this.reclaimed.get(req.fh) !== req.path) { throw new UnixError(unix.ESTALE); }
+        this.reclaimed.delete(req.fh);
+        this.store.set(req.fh, stored = {path: req.path, object: null, owned: false, dirty: false});
+        if (!this.byPath.has(req.path)) { this.byPath.set(req.path, new Set()); }
+        this.byPath.get(req.path).add(req.fh);
+      }
+      stored.lastUsed = Date.now();
+      if (!stored.object) { this.set(stored, object, false); this.evict(); }
+      return stored.object;
+    },
+    // ...that it's OK to change in place
+    async getWritableObjectForHandle(req, load) {
+      const object = await this.getObjectForHandle(req, load);
+      const stored = this.store.get(req.fh);
+      if (!stored.owned) { this.set(stored, object.slice(), true); }
+      return stored.object;
+    },
+    markDirty(handle) { this.store.get(handle).dirty = true; },
+    setObjectForHandle(handle, object) { this.set(this.store.get(handle), object, true); },
+    removeObjectForHandle(handle) {
+      this.reclaimed.delete(handle);
+      const stored = this.store.get(handle);
+      if (!stored) { return; }
+      this.letGo(stored.object);
+      this.store.delete(handle);
+      const handles = this.byPath.get(stored.path);
+      handles.delete(handle);
+      if (handles.size === 0) { this.byPath.delete(stored.path); }
+      if (this.store.size === 0) { this.stopSweeping(); }
+    },
     setObjectForPath(path, object) {
-      for (let storedObject of Object.values(this.store)) {
-        if (storedObject.path === path) {
-          storedObject.object = object;
+      for (let handle of this.byPath.get(path) || []) {
+        this.set(this.store.get(handle), object, false);
+      }
+    },
+    // what's at or under path changed (see invalidate()): open handles
+    // keep what they have, so a read in the middle doesn't come out
+    // half old and half new, until they read from the top again
+    invalidateTree(path) {
+      const under = path === '/' ? '/' : path + '/';
+      for (let [key, handles] of this.byPath) {
+        if (key !== path && !key.startsWith(under)) { continue; }
+        for (let handle of handles) { this.store.get(handle).stale = true; }
+      }
+    },
+
+    evict() {
+      if (this.bytes <= this.budget) { return; }
+      const clean = [...this.store.values()]
+            .filter(stored => stored.object && !stored.dirty)
+            .sort((a, b) => a.lastUsed - b.lastUsed);
+      for (let stored of clean) {
+        if (this.bytes <= this.budget) { break; }
+        this.set(stored, null, false);
+        this.stats.evictions++;
+      }
+    },
+    sweep() {
+      const now = Date.now();
+      for (let [handle, stored] of this.store) {
+        if (stored.dirty) { continue; }
+        if (now - stored.lastUsed > this.abandonMs) {
+          this.removeObjectForHandle(handle);
+          this.reclaimed.set(handle, stored.path);
+          this.stats.reclaimed++;
+        } else if (stored.object && now - stored.lastUsed > this.idleMs) {
+          this.set(stored, null, false);
+          this.stats.evictions++;
         }
       }
+    },
+    startSweeping() {
+      if (!this.sweeper) { this.sweeper = setInterval(() => this.sweep(), this.idleMs / 2); }
+    },
+    stopSweeping() { clearInterval(this.sweeper); this.sweeper = null; },
+
+    toJSON() {
+      return { handles: this.store.size, paths: this.byPath.size, buffers: this.refs.size,
+               bytes: this.bytes, budget: this.budget, ...this.stats };
     }
   };
 
+  function resize(arr, size) {
+    if (size === arr.length) { return arr; }
+    const newArr = new Uint8Array(size);
+    newArr.set(arr.slice(0, Math.min(size, arr.length)));
+    return newArr;
+  }
+
   function toUtf8Array(stringOrArray) {
     if (typeof stringOrArray == 'string') { return stringToUtf8Array(stringOrArray); }
     else { return stringOrArray; }
   }
 
-  const makeRouteWithContents = (getData, setData) => ({
+  // Contents we got from getData recently, by path. getattr (to get
+  // st_size) and then open usually come right after each other, and
+  // for text.txt and friends each getData is a trip into the page, so
+  // they share one. Requests that come in while a getData is still
+  // running wait on that one instead of starting their own.
+  //
+  // Entries go away `cache` ms (an option to makeRouteWithContents)
+  // after they come in, when the file gets written, and when the
+  // browser says something under that path changed, like the tab
+  // navigating (see invalidate() below).
+  const fetchData = async (req, getData) => toUtf8Array(await getData(req));
+
+  // Writes (and truncates through an open file) only change the open
+  // file's copy of the contents and mark it dirty. We hand the whole
+  // thing to setData once, when the file gets flushed (on close) or
+  // fsynced, instead of on every chunk -- setData might be recompiling
+  // a script or running an eval.
+  async function commit(req, setData) {
+    const stored = Cache.store.get(req.fh);
+    // (a handle from before the extension reloaded: whatever was
+    // written through it is gone, so don't pretend it's saved)
+    if (!stored && !Cache.reclaimed.has(req.fh)) { throw new UnixError(unix.ESTALE); }
+    if (!stored || !stored.dirty) { return; }
+    stored.dirty = false;
+    ContentCache.invalidate(req.path);
+    await setData(req, utf8ArrayToString(stored.object));
+  }
+  const ContentCache = {
+    entries: new Map(), // path -> Promise<Uint8Array|undefined>
+    hits: 0, misses: 0,
+    get(req, getData, ms) {
+      if (!ms) { this.misses++; return fetchData(req, getData); }
+
+      const {path} = req;
+      let entry = this.entries.get(path);
+      if (entry) { this.hits++; return entry; }
+      this.misses++;
+
+      entry = fetchData(req, getData);
+      this.entries.set(path, entry);
+      const forget = () => {
+        if (this.entries.get(path) === entry) { this.entries.delete(path); }
+      };
+      entry.then(() => setTimeout(forget, ms), forget);
+      return entry;
+    },
+    toJSON() { return { entries: this.entries.size, hits: this.hits, misses: this.misses }; },
+    invalidate(path) { this.entries.delete(path); },
+    invalidateTree(path) {
+      for (let key of this.entries.keys()) {
+        if (key === path || key.startsWith(path + '/')) { this.entries.delete(key); }
+      }
+    }
+  };
+
+  async function load(req, getData, ms) {
+    const data = await ContentCache.get(req, getData, ms);
+    if (typeof data === 'undefined') { throw new UnixError(unix.ENOENT); }
+    return data;
+  }
+
+  const makeRouteWithContents = (getData, setData, {cache = 1000, version} = {}) => ({
     // getData: (req: Request U Vars) -> Promise<contentsOfFile: String|Uint8Array>
     // setData [optional]: (req: Request U Vars, newContentsOfFile: String) -> Promise<>
+    // cache [optional]: ms to hang on to what getData returned, so a
+    //   getattr/open/truncate right after it can use it (0 = don't)
+    // version [optional]: (req: Request U Vars) -> Promise<String>, for
+    //   files whose contents only change when this does. Lets the
+    //   kernel keep the file in its page cache, from open to open for
+    //   as long as the version stays the same (see tabfs_open)
 
     // You can override file operations (like `truncate` or `getattr`)
     // in the returned set if you want different behavior from what's
     // defined here.
 
     async getattr(req) {
-      const data = await getData(req);
-      if (typeof data === 'undefined') { throw new UnixError(unix.ENOENT); }
+      const data = await load(req, getData, cache);
       return {
         st_mode: unix.S_IFREG | 0444 | (setData ? 0222 : 0),
         st_nlink: 1,
-        // you'll want to override this if getData() is slow, because
-        // getattr() gets called a lot more cavalierly than open().
-        st_size: toUtf8Array(data).length
+        // you'll want to override this if getData() is slow and you
+        // turned off `cache`, because getattr() gets called a lot more
+        // cavalierly than open().
+        st_size: data.length
       };
     },
 
-    // We call getData() once when the file is opened, then cache that
-    // data for all subsequent reads from that application.
+    // We get data once when the file is opened, then cache that data
+    // for all subsequent reads from that application.
     async open(req) {
-      const data = await getData(req);
-      if (typeof data === 'undefined') { throw new UnixError(unix.ENOENT); }
-      return { fh: Cache.storeObject(req.path, toUtf8Array(data)) };
+      // (version first: if the contents change in between, we'd rather
+      // call new contents old than old contents new)
+      const v = version && String(await version(req));
+      const data = await load(req, getData, cache);
+      const fh = Cache.storeObject(req.path, data);
+      return version ? { fh, cache: true, version: v } : { fh };
     },
-    async read({fh, size, offset}) {
-      return { buf: Cache.getObjectForHandle(fh).slice(offset, offset + size) };
+    async read(req) {
+      const {size, offset} = req;
+      const data = await Cache.getObjectForHandle(req, () => load(req, getData, cache));
+      return { buf: data.slice(offset, offset + size) };
     },
     async write(req) {
+      if (!setData) { throw new UnixError(unix.EPERM); }
       const {fh, offset, buf} = req;
-      let arr = Cache.getObjectForHandle(fh);
+      let arr = await Cache.getWritableObjectForHandle(req, () => load(req, getData, cache));
       const bufarr = stringToUtf8Array(buf);
       if (offset + bufarr.length > arr.length) {
         const newArr = new Uint8Array(offset + bufarr.length);
@@ -160,49 +414,254 @@ const makeRouteWithContents = (function() {
         Cache.setObjectForHandle(fh, arr);
       }
       arr.set(bufarr, offset);
-      // I guess caller should override write() if they want to actually
-      // patch and not just re-set the whole string (for example,
-      // if they want to hot-reload just one function the user modified)
-      await setData(req, utf8ArrayToString(arr)); return { size: bufarr.length };
+      Cache.markDirty(fh);
+      return { size: bufarr.length };
+    },
+    // I guess caller should override flush() if they want to actually
+    // patch and not just re-set the whole string (for example,
+    // if they want to hot-reload just one function the user modified)
+    async flush(req) { await commit(req, setData); return {}; },
+    async fsync(req) { await commit(req, setData); return {}; },
+    async release(req) {
+      // (FUSE flushes before it releases, so this is just in case)
+      try { await commit(req, setData); }
+      finally { Cache.removeObjectForHandle(req.fh); }
+      return {};
     },
-    async release({fh}) { Cache.removeObjectForHandle(fh); return {}; },
 
     async truncate(req) {
-      let arr = toUtf8Array(await getData(req));
-      if (req.size !== arr.length) {
-        const newArr = new Uint8Array(req.size);
-        newArr.set(arr.slice(0, Math.min(req.size, arr.length)));
-        arr = newArr;
+      if (req.fh) {
+        // truncating an open file (probably opened with O_TRUNC):
+        // just like a write
+        const arr = await Cache.getObjectForHandle(req, () => load(req, getData, cache));
+        // (resize copies, unless the size stays the same)
+        Cache.setObjectForHandle(req.fh, arr.length === req.size ? arr.slice() : resize(arr, req.size));
+        Cache.markDirty(req.fh);
+        return {};
       }
+      const arr = resize((await load(req, getData, cache)).slice(), req.size);
       Cache.setObjectForPath(req.path, arr);
+      ContentCache.invalidate(req.path);
       await setData(req, utf8ArrayToString(arr)); return {};
     }
   });
   makeRouteWithContents.Cache = Cache;
+  makeRouteWithContents.ContentCache = ContentCache;
   return makeRouteWithContents;
 })();
 
-// Helper function: returns a route handler for `path` based on all
-// the children of `path` that already exist in Routes.
+// Helper functions for readdir: a readdir can return an `attrs` array
+// alongside `entries`, with the getattr result (or null, if we don't
+// know it offhand) for each entry. tabfs hands those to the kernel and
+// caches them, so `ls -l` doesn't have to come back to us to getattr
+// every single tab.
+const attrsForDirectory = () => ({
+  st_mode: unix.S_IFDIR | 0755,
+  st_nlink: 3,
+  st_size: 0,
+});
+const attrsForSymlink = target => ({
+  st_mode: unix.S_IFLNK | 0444,
+  st_nlink: 1,
+  st_size: String(target).length + 1, // must match readlink, see below
+});
+
+// Helper function: returns a route handler for a directory at `path`
+// whose entries are all the children of `path` in Routes that don't
+// have variables in them. They're looked up when you readdir, so routes
+// added later show up too.
 // 
 // e.g., if `Routes['/tabs/create']` and `Routes['/tabs/by-id']` and
-// `Routes['/tabs/last-focused']` are all already defined, then
+// `Routes['/tabs/last-focused']` are all defined, then
 // `makeDefaultRouteForDirectory('/tabs')` will return a route that
 // defines a directory with entries 'create', 'by-id', and
 // 'last-focused'.
 function makeDefaultRouteForDirectory(path) {
-  function depth(p) { return p === '/' ? 0 : (p.match(/\//g) || []).length; }
+  return {
+    readdir() {
+      const children = [...trieNodeForKey(path).literals]
+            .filter(([name, node]) => node.route);
+      const entries = [".", "..", ...children.map(([name, node]) => name)];
+      // subdirectory getattrs are cheap and synchronous, so send them
+      // along; leave files alone, since their getattr might have to
+      // go generate the whole file.
+      const attrs = [null, null, ...children.map(([name, {route}]) => {
+        if (!route.readdir) { return null; }
+        const attr = route.getattr({path: (path === '/' ? '' : path) + '/' + name});
+        return attr instanceof Promise ? null : attr;
+      })];
+      return { entries, attrs };
+    },
+    __isInfill: true
+  };
+}
+
+// Which tabs and windows are open, kept up to date from tabs.* and
+// windows.* events instead of asking the browser on every readdir (with
+// a thousand tabs open, tabs.query alone takes a good while). Each tab
+// comes with its listing entry names already sanitized.
+//
+// Loaded on first use. If an event shows up while we're loading, the
+// snapshot might already be stale, so we load again.
+const TabIndex = (function() {
+  const tabs = new Map(); // tab id -> {tab, byTitle, byWindow, inWindow}
+  const windows = new Map(); // window id -> {window, tabIds: Set, activeTabId}
+  let lastFocusedWindowId;
+  let loaded, loading = null, stale = false;
+
+  function windowEntry(windowId) {
+    let w = windows.get(windowId);
+    if (!w) {
+      w = { window: { id: windowId }, tabIds: new Set(), activeTabId: undefined };
+      windows.set(windowId, w);
+    }
+    return w;
+  }
+  function putTab(tab) {
+    const old = tabs.get(tab.id);
+    if (old && old.tab.windowId !== tab.windowId) { windowEntry(old.tab.windowId).tabIds.delete(tab.id); }
+    tabs.set(tab.id, {
+      tab,
+      byTitle: sanitize(String(tab.title)) + "." + String(tab.id),
+      byWindow: sanitize(String(tab.windowId) + "." + String(tab.title)) + "." + String(tab.id),
+      inWindow: sanitize(String(tab.title) + "." + String(tab.id))
+    });
+    const w = windowEntry(tab.windowId);
+    w.tabIds.add(tab.id);
+    if (tab.active) { w.activeTabId = tab.id; }
+  }
+  function removeTab(tabId) {
+    const entry = tabs.get(tabId);
+    if (!entry) { return; }
+    tabs.delete(tabId);
+    const w = windows.get(entry.tab.windowId);
+    if (w) {
+      w.tabIds.delete(tabId);
+      if (w.activeTabId === tabId) { w.activeTabId = undefined; }
+    }
+  }
+  // tab indexes after the one at `fromIndex` in `windowId` move by `by`
+  function shiftIndexes(windowId, fromIndex, by) {
+    const w = windows.get(windowId);
+    if (!w) { return; }
+    for (let id of w.tabIds) {
+      const {tab} = tabs.get(id);
+      if (tab.index >= fromIndex) { tab.index += by; }
+    }
+  }
 
-  // find all direct children
-  let entries = Object.keys(Routes)
-      .filter(k => k.startsWith(path) && depth(k) === depth(path) + 1)
-      .map(k => k.substr((path === '/' ? 0 : path.length) + 1).split('/')[0])
-      // exclude entries with variables like :FILENAME in them
-      .filter(k => !k.includes("#") && !k.includes(":"));
+  async function load() {
+    do {
+      stale = false;
+      const [allTabs, allWindows, lastFocused] = await Promise.all([
+        browser.tabs.query({}), browser.windows.getAll(), browser.windows.getLastFocused()
+      ]);
+      tabs.clear(); windows.clear();
+      for (let window of allWindows) { windowEntry(window.id).window = window; }
+      for (let tab of allTabs) { putTab(tab); }
+      lastFocusedWindowId = lastFocused && lastFocused.id;
+    } while (stale);
+    loaded = true;
+  }
+  async function ready() {
+    if (loaded) { return; }
+    if (!loading) { loading = load().finally(() => { loading = null; }); }
+    await loading;
+  }
+  // wraps an event handler so it's dropped (and the load redone) if
+  // we're in the middle of loading, and ignored if we've never loaded
+  const onEvent = fn => (...args) => {
+    if (loaded) { fn(...args); }
+    else if (loading) { stale = true; }
+  };
 
-  entries = [".", "..", ...new Set(entries)];
-  return { readdir() { return { entries }; }, __isInfill: true };
-}
+  function listen() {
+    browser.tabs.onCreated.addListener(onEvent(tab => {
+      shiftIndexes(tab.windowId, tab.index, 1);
+      putTab(tab);
+    }));
+    browser.tabs.onUpdated.addListener(onEvent((tabId, changeInfo, tab) => { putTab(tab); }));
+    browser.tabs.onRemoved.addListener(onEvent((tabId, {windowId}) => {
+      const entry = tabs.get(tabId);
+      removeTab(tabId);
+      if (entry) { shiftIndexes(windowId, entry.tab.index, -1); }
+    }));
+    browser.tabs.onActivated.addListener(onEvent(({tabId, windowId}) => {
+      const w = windowEntry(windowId);
+      const previous = tabs.get(w.activeTabId);
+      if (previous) { previous.tab.active = false; }
+      const entry = tabs.get(tabId);
+      if (entry) { entry.tab.active = true; }
+      w.activeTabId = tabId;
+    }));
+    browser.tabs.onMoved.addListener(onEvent((tabId, {windowId, fromIndex, toIndex}) => {
+      const entry = tabs.get(tabId);
+      if (!entry) { return; }
+      shiftIndexes(windowId, fromIndex + 1, -1);
+      shiftIndexes(windowId, toIndex, 1);
+      entry.tab.index = toIndex;
+    }));
+    browser.tabs.onDetached.addListener(onEvent((tabId, {oldWindowId, oldPosition}) => {
+      const entry = tabs.get(tabId);
+      if (!entry) { return; }
+      removeTab(tabId);
+      tabs.set(tabId, entry); // (still open, just in no window for now)
+      shiftIndexes(oldWindowId, oldPosition, -1);
+    }));
+    browser.tabs.onAttached.addListener(onEvent((tabId, {newWindowId, newPosition}) => {
+      const entry = tabs.get(tabId);
+      if (!entry) { return; }
+      shiftIndexes(newWindowId, newPosition, 1);
+      putTab({ ...entry.tab, windowId: newWindowId, index: newPosition });
+    }));
+    browser.windows.onCreated.addListener(onEvent(window => { windowEntry(window.id).window = window; }));
+    browser.windows.onRemoved.addListener(onEvent(windowId => {
+      const w = windows.get(windowId);
+      if (!w) { return; }
+      for (let tabId of w.tabIds) { tabs.delete(tabId); }
+      windows.delete(windowId);
+    }));
+    browser.windows.onFocusChanged.addListener(onEvent(windowId => {
+      if (windowId === -1) { return; } // WINDOW_ID_NONE: focus went to some other app
+      for (let [id, w] of windows) { w.window.focused = id === windowId; }
+      lastFocusedWindowId = windowId;
+    }));
+  }
+
+  return {
+    listen,
+    // (all of these are O(what they return), no browser calls once loaded)
+    async entries() { await ready(); return [...tabs.values()]; },
+    async entriesInWindow(windowId) {
+      await ready();
+      const w = windows.get(windowId);
+      return w ? [...w.tabIds].map(id => tabs.get(id)) : [];
+    },
+    async windows() { await ready(); return [...windows.values()].map(w => w.window); },
+    // falls back to asking the browser, in case we're behind on events
+    async tab(tabId) {
+      await ready();
+      const entry = tabs.get(tabId);
+      return entry ? entry.tab : browser.tabs.get(tabId);
+    },
+    async window(windowId) {
+      await ready();
+      const w = windows.get(windowId);
+      return w && w.window.focused !== undefined ? w.window : browser.windows.get(windowId);
+    },
+    async lastFocusedWindowId() {
+      await ready();
+      return lastFocusedWindowId !== undefined ? lastFocusedWindowId
+        : (await browser.windows.getLastFocused()).id;
+    },
+    async lastFocusedTabId() {
+      await ready();
+      const w = windows.get(lastFocusedWindowId);
+      return w && w.activeTabId !== undefined ? w.activeTabId
+        : (await browser.tabs.query({ active: true, lastFocusedWindow: true }))[0].id;
+    }
+  };
+})();
 
 Routes["/tabs/create"] = {
   description: 'Create a new tab.',
@@ -226,8 +685,11 @@ Routes["/tabs/by-title"] = {
     };
   },
   async readdir() {
-    const tabs = await browser.tabs.query({});
-    return { entries: [".", "..", ...tabs.map(tab => sanitize(String(tab.title)) + "." + String(tab.id))] };
+    const tabs = await TabIndex.entries();
+    return {
+      entries: [".", "..", ...tabs.map(({byTitle}) => byTitle)],
+      attrs: [null, null, ...tabs.map(({tab}) => attrsForSymlink("../by-id/" + tab.id))]
+    };
   }
 };
 
@@ -256,8 +718,11 @@ Routes["/tabs/by-window"] = {
     };
   },
   async readdir() {
-    const tabs = await browser.tabs.query({});
-    return { entries: [".", "..", ...tabs.map(tab => sanitize(String(tab.windowId) + "." + String(tab.title)) + "." + String(tab.id))] };
+    const tabs = await TabIndex.entries();
+    return {
+      entries: [".", "..", ...tabs.map(({byWindow}) => byWindow)],
+      attrs: [null, null, ...tabs.map(({tab}) => attrsForSymlink("../by-id/" + tab.id))]
+    };
   }
 };
 
@@ -280,7 +745,7 @@ Routes["/tabs/last-focused"] = {
   description: `Represents the most recently focused tab.
 It's a symbolic link to the folder /tabs/by-id/[ID of most recently focused tab].`,
   async readlink() {
-    const id = (await browser.tabs.query({ active: true, lastFocusedWindow: true }))[0].id;
+    const id = await TabIndex.lastFocusedTabId();
     return { buf: "by-id/" + id };
   }
 };
@@ -289,8 +754,11 @@ Routes["/tabs/by-id"] = {
   description: `Open tabs, organized by ID; each subfolder represents an open tab.`,
   usage: 'ls $0',
   async readdir() {
-    const tabs = await browser.tabs.query({});
-    return { entries: [".", "..", ...tabs.map(tab => String(tab.id))] };
+    const tabs = await TabIndex.entries();
+    return {
+      entries: [".", "..", ...tabs.map(({tab}) => String(tab.id))],
+      attrs: [null, null, ...tabs.map(() => attrsForDirectory())]
+    };
   }
 };
 
@@ -313,18 +781,224 @@ Routes["/tabs/by-id"] = {
 
 // TODO: can I trigger 1. nav to Finder and 2. nav to Terminal from toolbar click?
 
+// Runs fn(tab) on every open tab, at most `concurrency` at a time,
+// giving each one `timeout` ms, and returns JSON lines, one per tab in
+// /tabs/by-id order: {id, [key]: result}, or {id, error} if it threw
+// or timed out. Tabs still waiting their turn once the whole pass has
+// taken `total` ms just get an ETIMEDOUT, so you get what we have
+// before tabfs gives up on the request.
+//
+// (This is what /tabs/all is: one pass over every tab, with the
+// browser doing them in parallel, instead of a round trip per tab per
+// file.)
+const ALL_TABS = { concurrency: 16, timeout: 2000, total: 20000 };
+function errorName(e) {
+  if (e instanceof UnixError) {
+    return Object.keys(unix).find(name => unix[name] === e.error) || String(e.error);
+  }
+  return e && e.message || String(e);
+}
+async function jsonLinesForAllTabs(key, fn, {concurrency, timeout, total} = ALL_TABS) {
+  const tabs = (await TabIndex.entries()).map(({tab}) => tab);
+  const lines = new Array(tabs.length);
+  const deadline = performance.now() + total;
+  let next = 0;
+  async function worker() {
+    while (next < tabs.length) {
+      const i = next++, tab = tabs[i];
+      let timer;
+      try {
+        const ms = Math.min(timeout, deadline - performance.now());
+        if (ms <= 0) { throw new UnixError(unix.ETIMEDOUT); }
+        const result = await Promise.race([
+          fn(tab),
+          new Promise((resolve, reject) => {
+            timer = setTimeout(() => reject(new UnixError(unix.ETIMEDOUT)), ms);
+          })
+        ]);
+        lines[i] = JSON.stringify({ id: tab.id, [key]: result === undefined ? null : result });
+      } catch (e) {
+        lines[i] = JSON.stringify({ id: tab.id, error: errorName(e) });
+      } finally {
+        clearTimeout(timer);
+      }
+    }
+  }
+  await Promise.all(Array.from({length: Math.min(concurrency, tabs.length)}, worker));
+  return lines.map(line => line + '\n').join('');
+}
+
+// What a tab's agent (below) can do for us, in the page. Gets
+// turned into source and injected, so it can't see anything else in
+// this file.
+function agentOps() {
+  return {
+    text() { return document.body.innerText; },
+    html() { return document.body.innerHTML; },
+    // TODO: assign new IDs to inputs without them?
+    inputs() {
+      return Array.from(document.querySelectorAll('textarea, input[type=text]'))
+        .map(e => e.id).filter(id => id);
+    },
+    getInput({id}) {
+      const e = document.getElementById(id);
+      return e ? e.value : null;
+    },
+    setInput({id, value}) { document.getElementById(id).value = value; },
+    // (in the content script's world, like executeScript, not the page's)
+    eval({code}) { return (0, eval)(code); }
+  };
+}
+// The agent itself: a content script that connects back to us and
+// stays, answering calls that come over its port. Each call gets its
+// answer as soon as it has one, {id, value} or {id, error}; strings
+// bigger than CHUNK come back in pieces, {id, chunk, more: true} until
+// the last one, so no one message has to hold a whole page. (A value
+// that can't be sent, like an eval that returns something circular,
+// is an error, too.)
+function tabfsAgent(makeOps) {
+  const CHUNK = 256 * 1024;
+  if (!window.__tabfsAgent) {
+    const ops = makeOps();
+    window.__tabfsAgent = (port, {calls}) => {
+      for (let {id, op, ...args} of calls) {
+        // (wrapped, so a promise comes back as is, like executeScript
+        // would, and doesn't get waited on)
+        Promise.resolve().then(() => ({ value: ops[op](args) })).then(({value}) => {
+          if (typeof value !== 'string' || value.length <= CHUNK) {
+            port.postMessage({id, value});
+            return;
+          }
+          for (let at = 0; at < value.length; at += CHUNK) {
+            port.postMessage({id, chunk: value.slice(at, at + CHUNK), more: at + CHUNK < value.length});
+          }
+        }).catch(e => port.postMessage({id, error: String(e && e.message || e)}));
+      }
+    };
+  }
+  // (if we were already here, the old port's gone, or they wouldn't
+  // have injected us again)
+  const port = chrome.runtime.connect({name: 'tabfs-agent'});
+  port.onMessage.addListener(message => window.__tabfsAgent(port, message));
+}
+// Our end of the agents: one per tab, injected the first time we need
+// something from that tab, so reading text.txt and friends is a
+// message over a port instead of injecting and compiling a script
+// every time. Calls to the same tab in the same tick go over in one
+// message, and any number can be outstanding. A navigation takes the
+// agent with it (its port disconnects), and the next call injects a
+// new one; calls that were waiting on the old one go again, once, on
+// the new one, if they're just reads (an eval might have happened
+// already, or be what navigated). Without runtime.onConnect (in node),
+// each call is its own executeScript, like before.
+const Agents = {
+  byTab: new Map(), // tabId -> {port: Promise<Port>, queue, waiting: Map(id -> {message, resolve, reject, parts, retry})}
+  connecting: new Map(), // tabId -> resolve(port)
+  listening: false, nextId: 0,
+  CONNECT_TIMEOUT: 5000,
+  READS: new Set(['text', 'html', 'inputs', 'getInput']),
+
+  listen() {
+    if (!browser.runtime || !browser.runtime.onConnect) { return; }
+    this.listening = true;
+    browser.runtime.onConnect.addListener(port => {
+      if (port.name !== 'tabfs-agent' || !port.sender.tab) { return; }
+      const resolve = this.connecting.get(port.sender.tab.id);
+      if (!resolve) { port.disconnect(); return; }
+      this.connecting.delete(port.sender.tab.id);
+      resolve(port);
+    });
+  },
+  async connect(tabId) {
+    let timer;
+    const connected = new Promise((resolve, reject) => {
+      this.connecting.set(tabId, resolve);
+      timer = setTimeout(() => reject(new UnixError(unix.ETIMEDOUT)), this.CONNECT_TIMEOUT);
+    });
+    try {
+      await browser.tabs.executeScript(tabId, {code: `(${tabfsAgent})(${agentOps})`});
+      return await connected;
+    } finally {
+      clearTimeout(timer);
+      this.connecting.delete(tabId);
+    }
+  },
+  agent(tabId) {
+    let agent = this.byTab.get(tabId);
+    if (agent) { return agent; }
+    agent = { queue: [], waiting: new Map(), port: this.connect(tabId) };
+    this.byTab.set(tabId, agent);
+    agent.port.then(port => {
+      port.onMessage.addListener(message => this.answer(agent, message));
+      port.onDisconnect.addListener(() => this.drop(tabId, agent, new Error('page went away'), true));
+    }, e => this.drop(tabId, agent, e));
+    return agent;
+  },
+  answer(agent, {id, value, error, chunk, more}) {
+    const call = agent.waiting.get(id);
+    if (!call) { return; }
+    if (chunk !== undefined) {
+      call.parts.push(chunk);
+      if (more) { return; }
+      value = call.parts.join('');
+    }
+    agent.waiting.delete(id);
+    if (error !== undefined) { call.reject(new Error(error)); }
+    // (executeScript gives you null for undefined, too)
+    else { call.resolve(value === undefined ? null : value); }
+  },
+  drop(tabId, agent, e, disconnected = false) {
+    if (this.byTab.get(tabId) === agent) { this.byTab.delete(tabId); }
+    const waiting = [...agent.waiting.values()];
+    agent.waiting.clear();
+    for (let call of waiting) {
+      if (disconnected && call.retry) {
+        call.retry = false;
+        this.send(tabId, call);
+      } else {
+        call.reject(e);
+      }
+    }
+  },
+  async flush(agent) {
+    let port;
+    try { port = await agent.port; } catch (e) { return; } // (drop() rejected them)
+    const calls = agent.queue;
+    agent.queue = [];
+    if (calls.length > 0) { port.postMessage({calls}); }
+  },
+
+  // op (one of agentOps) in tab tabId -> Promise<what it returned>
+  call(tabId, op, args = {}) {
+    if (!this.listening) {
+      return browser.tabs.executeScript(tabId, {
+        code: `(${agentOps})()[${JSON.stringify(op)}](${JSON.stringify(args)})`
+      }).then(results => results[0]);
+    }
+    return new Promise((resolve, reject) => this.send(tabId, {
+      message: {id: ++this.nextId, op, ...args}, resolve, reject, retry: this.READS.has(op)
+    }));
+  },
+  send(tabId, call) {
+    const agent = this.agent(tabId);
+    call.parts = [];
+    agent.waiting.set(call.message.id, call);
+    if (agent.queue.push(call.message) === 1) {
+      Promise.resolve().then(() => this.flush(agent));
+    }
+  }
+};
+
 (function() {
   const routeForTab = (readHandler, writeHandler) => makeRouteWithContents(async ({tabId}) => {
-    const tab = await browser.tabs.get(tabId);
+    const tab = await TabIndex.tab(tabId);
     return readHandler(tab);
 
   }, writeHandler ? async ({tabId}, buf) => {
     await browser.tabs.update(tabId, writeHandler(buf));
   } : undefined);
 
-  const routeFromScript = code => makeRouteWithContents(async ({tabId}) => {
-    return (await browser.tabs.executeScript(tabId, {code}))[0];
-  });
+  const routeFromAgent = op => makeRouteWithContents(({tabId}) => Agents.call(tabId, op));
 
   Routes["/tabs/by-id/#TAB_ID/url.txt"] = {
     description: `Text file containing the current URL of this tab.`,
@@ -338,15 +1012,18 @@ Routes["/tabs/by-id"] = {
     usage: 'cat $0',
     ...routeForTab(tab => tab.title + "\n")
   };
+  // (a big page can take a while to serialize)
   Routes["/tabs/by-id/#TAB_ID/text.txt"] = {
     description: `Text file containing the current body text of this tab.`,
     usage: 'cat $0',
-    ...routeFromScript(`document.body.innerText`)
+    ...routeFromAgent('text'),
+    timeout: 5000
   };
   Routes["/tabs/by-id/#TAB_ID/body.html"] = {
     description: `Text file containing the current body HTML of this tab.`,
     usage: 'cat $0',
-    ...routeFromScript(`document.body.innerHTML`)
+    ...routeFromAgent('html'),
+    timeout: 5000
   };
 
   Routes["/tabs/by-id/#TAB_ID/active"] = {
@@ -360,12 +1037,41 @@ Routes["/tabs/by-id"] = {
       buf => ({ active: buf.startsWith("true") })
     )
   };
+
+  // every tab's one of those at once, a JSON line per tab. (held on
+  // to for a few seconds, since it's a lot of work, and getattr, open
+  // and read all want it)
+  const routeForAllTabs = (key, fn) => ({
+    usage: 'cat $0',
+    ...makeRouteWithContents(() => jsonLinesForAllTabs(key, fn), undefined, {cache: 5000}),
+    timeout: ALL_TABS.total + 5000
+  });
+  Routes["/tabs/all/url.jsonl"] = {
+    description: `Every tab's URL, as JSON lines of {"id": ..., "url": ...}.`,
+    ...routeForAllTabs('url', tab => tab.url)
+  };
+  Routes["/tabs/all/title.jsonl"] = {
+    description: `Every tab's title, as JSON lines of {"id": ..., "title": ...}.`,
+    ...routeForAllTabs('title', tab => tab.title)
+  };
+  Routes["/tabs/all/text.jsonl"] = {
+    description: `Every tab's body text, as JSON lines of {"id": ..., "text": ...}.
+Tabs that error or take too long get {"id": ..., "error": ...} instead.`,
+    ...routeForAllTabs('text', tab => Agents.call(tab.id, 'text'))
+  };
+  Routes["/tabs/all/body.jsonl"] = {
+    description: `Every tab's body HTML, as JSON lines of {"id": ..., "html": ...}.`,
+    ...routeForAllTabs('html', tab => Agents.call(tab.id, 'html'))
+  };
 })();
-function createWritableDirectory() {
+function createWritableDirectory(onChange) {
   // Returns a 'writable directory' object, which represents a
   // writable directory that users can put arbitrary stuff into. It's
   // not itself a route, but it has .routeForRoot and
   // .routeForFilename properties that are routes.
+  //
+  // onChange [optional]: (req: Request U Vars, newContentsOfFile: String) -> Promise<>
+  //   gets called when a file in the directory is done being written.
   
   const dir = {};
   return {
@@ -398,7 +1104,12 @@ function createWritableDirectory() {
 
       ...makeRouteWithContents(
         async ({path}) => dir[path],
-        async ({path}, buf) => { dir[path] = buf; }
+        async (req, buf) => {
+          dir[req.path] = buf;
+          if (onChange) { await onChange(req, buf); }
+        },
+        // (already in memory, and evals puts .result files in dir itself)
+        { cache: 0 }
       )
     }
   };
@@ -406,7 +1117,15 @@ function createWritableDirectory() {
 
 
 (function() {
-  const evals = createWritableDirectory();
+  const evals = createWritableDirectory(async (req, code) => {
+    // runs once you're done writing the file (on close)
+    const allFrames = req.path.endsWith('.all-frames.js');
+    // (the agent's only in the top frame)
+    // TODO: return other results beyond [0] (when all-frames is on)
+    const result = allFrames ? (await browser.tabs.executeScript(req.tabId, {code, allFrames}))[0]
+                             : await Agents.call(req.tabId, 'eval', {code});
+    evals.directory[req.path + '.result'] = JSON.stringify(result) + '\n';
+  });
   Routes["/tabs/by-id/#TAB_ID/evals"] = {
     ...evals.routeForRoot,
     description: `Add JavaScript files to this folder to evaluate them in the tab.`,
@@ -418,15 +1137,27 @@ function createWritableDirectory() {
     // FIXME: document allFrames option
     usage: ['echo "2 + 2" > tabs/by-id/#TAB_ID/evals/twoplustwo.js',
             'cat tabs/by-id/#TAB_ID/evals/twoplustwo.js.result'],
-    async write(req) {
-      const ret = await evals.routeForFilename.write(req);
-      const code = evals.directory[req.path];
-      const allFrames = req.path.endsWith('.all-frames.js');
-      // TODO: return other results beyond [0] (when all-frames is on)
-      const result = (await browser.tabs.executeScript(req.tabId, {code, allFrames}))[0];
-      evals.directory[req.path + '.result'] = JSON.stringify(result) + '\n';
-      return ret;
-    }
+    // the eval runs on close
+    timeout: {flush: 10000, fsync: 10000, release: 10000}
+  };
+
+  const allEvals = createWritableDirectory(async (req, code) => {
+    const allFrames = req.path.endsWith('.all-frames.js');
+    allEvals.directory[req.path + '.result'] = await jsonLinesForAllTabs('result', async tab =>
+      allFrames ? (await browser.tabs.executeScript(tab.id, {code, allFrames}))[0]
+                : Agents.call(tab.id, 'eval', {code}));
+  });
+  Routes["/tabs/all/evals"] = {
+    ...allEvals.routeForRoot,
+    description: `Add JavaScript files to this folder to evaluate them in every tab at once.`,
+    usage: 'ls $0'
+  };
+  Routes["/tabs/all/evals/:FILENAME"] = {
+    ...allEvals.routeForFilename,
+    usage: ['echo "document.title" > $0',
+            'cat $0.result'],
+    timeout: {flush: ALL_TABS.total + 5000, fsync: ALL_TABS.total + 5000,
+              release: ALL_TABS.total + 5000}
   };
 })();
 (function() {
@@ -446,15 +1177,28 @@ Read that file to evaluate and return the current value of that JS expression.`,
       };
     },
   };
+  const POLL_INTERVAL = 1000;
+  const polling = new Map(); // path -> {handles, timer, last}
+  disconnectListeners.push(() => {
+    for (let p of polling.values()) { clearInterval(p.timer); }
+    polling.clear();
+  });
+  const contents = makeRouteWithContents(async ({tabId, expr}) => {
+    if (!watches[tabId] || !(expr in watches[tabId])) { throw new UnixError(unix.ENOENT); }
+    return JSON.stringify(await watches[tabId][expr]()) + '\n';
+
+  }, () => {
+    // setData handler -- only providing this so that getattr reports
+    // that the file is writable, so it can be deleted without annoying prompt.
+    throw new UnixError(unix.EPERM);
+  }, { cache: 0 }); // every read should re-evaluate
   Routes["/tabs/by-id/#TAB_ID/watches/:EXPR"] = {
     description: `A file with a JS expression :EXPR as its filename.`,
     usage: `touch '/tabs/by-id/#TAB_ID/watches/2+2' && cat '/tabs/by-id/#TAB_ID/watches/2+2'`,
     // NOTE: eval runs in extension's content script, not in original page JS context
     async mknod({tabId, expr, mode}) {
       watches[tabId] = watches[tabId] || {};
-      watches[tabId][expr] = async function() {
-        return (await browser.tabs.executeScript(tabId, {code: expr}))[0];
-      };
+      watches[tabId][expr] = () => Agents.call(tabId, 'eval', {code: expr});
       return {};
     },
     async unlink({tabId, expr}) {
@@ -462,16 +1206,112 @@ Read that file to evaluate and return the current value of that JS expression.`,
       return {};
     },
 
-    ...makeRouteWithContents(async ({tabId, expr}) => {
-      if (!watches[tabId] || !(expr in watches[tabId])) { throw new UnixError(unix.ENOENT); }
-      return JSON.stringify(await watches[tabId][expr]()) + '\n';
+    ...contents,
+    // someone's polling this watch (see tabfs_poll): evaluate it every
+    // so often on our end, and tell tabfs when the value changes
+    async poll({path, tabId, expr, fh}) {
+      let p = polling.get(path);
+      if (!p) {
+        polling.set(path, p = { handles: new Set(), last: undefined });
+        p.timer = setInterval(async () => {
+          try {
+            const value = JSON.stringify(await watches[tabId][expr]());
+            if (p.last !== undefined && value !== p.last) { invalidate(path); }
+            p.last = value;
+          } catch (e) {}
+        }, POLL_INTERVAL);
+      }
+      p.handles.add(fh);
+      return {};
+    },
+    async release(req) {
+      const p = polling.get(req.path);
+      if (p && p.handles.delete(req.fh) && p.handles.size === 0) {
+        clearInterval(p.timer);
+        polling.delete(req.path);
+      }
+      return contents.release(req);
+    }
+  };
+})();
+
+// Each tab's events (navigations, title changes, activations, ...) as
+// they happen, a JSON line each, in events.jsonl. It reads like a
+// pipe: once you've read everything, the next read waits for the next
+// event (tabfs does the waiting), so `cat events.jsonl` follows along.
+// We keep the last `cap` bytes of each tab's log; a reader that falls
+// further behind than that reads what it missed as blank lines. Only
+// for tabs that have events.jsonl open, though: with a lot of tabs,
+// that's a lot of logs nobody reads. Once a tab closes and you've read
+// everything, that's the end of the file.
+const TabEvents = (function() {
+  const cap = 64 * 1024;
+  const logs = new Map(); // tab id -> {base, text, closed, readers, timer}; text starts at byte `base`
+  // (all ASCII, so string offsets are byte offsets)
+  const ascii = str => str.replace(/[\u007f-\uffff]/g,
+                                   c => '\\u' + c.charCodeAt(0).toString(16).padStart(4, '0'));
+  function log(tabId, event, details) {
+    const l = logs.get(tabId);
+    if (!l) { return; }
+    l.text += ascii(JSON.stringify({ time: Date.now(), event, ...details })) + '\n';
+    if (l.text.length > cap) {
+      const cut = l.text.indexOf('\n', l.text.length - cap) + 1;
+      l.base += cut;
+      l.text = l.text.substring(cut);
+    }
+  }
 
-    }, () => {
-      // setData handler -- only providing this so that getattr reports
-      // that the file is writable, so it can be deleted without annoying prompt.
-      throw new UnixError(unix.EPERM);
-    })
+  Routes["/tabs/by-id/#TAB_ID/events.jsonl"] = {
+    description: `This tab's events (updated, activated, moved, removed, ...) as JSON lines,
+as they happen. Reading waits for more at the end, like a pipe.`,
+    usage: 'cat $0',
+    getattr() {
+      return { st_mode: unix.S_IFREG | 0444, st_nlink: 1, st_size: 0 };
+    },
+    open({tabId}) {
+      let l = logs.get(tabId);
+      if (!l) { logs.set(tabId, l = { base: 0, text: '', closed: false, readers: 0 }); }
+      l.readers++;
+      return { fh: 0, stream: true };
+    },
+    read({tabId, offset, size}) {
+      // (no log: it's been closed a while, or we reloaded since you
+      // opened it, and either way nothing more is coming)
+      const l = logs.get(tabId);
+      if (!l) { return { buf: '', eof: true }; }
+      if (offset < l.base) { return { buf: '\n'.repeat(Math.min(size, l.base - offset)) }; }
+      const buf = l.text.substring(offset - l.base, offset - l.base + size);
+      if (buf === '' && l.closed) { return { buf, eof: true }; }
+      return { buf };
+    },
+    release({tabId}) {
+      const l = logs.get(tabId);
+      if (l && --l.readers <= 0) { clearTimeout(l.timer); logs.delete(tabId); }
+      return {};
+    }
   };
+  disconnectListeners.push(() => {
+    for (let l of logs.values()) { clearTimeout(l.timer); }
+    logs.clear();
+  });
+
+  function listen() {
+    browser.tabs.onCreated.addListener(tab => log(tab.id, 'created', { url: tab.url, windowId: tab.windowId }));
+    browser.tabs.onUpdated.addListener((tabId, changeInfo) => log(tabId, 'updated', changeInfo));
+    browser.tabs.onActivated.addListener(({tabId, windowId}) => log(tabId, 'activated', { windowId }));
+    browser.tabs.onMoved.addListener((tabId, {fromIndex, toIndex}) => log(tabId, 'moved', { fromIndex, toIndex }));
+    browser.tabs.onAttached.addListener((tabId, {newWindowId}) => log(tabId, 'attached', { windowId: newWindowId }));
+    browser.tabs.onDetached.addListener((tabId, {oldWindowId}) => log(tabId, 'detached', { windowId: oldWindowId }));
+    browser.tabs.onRemoved.addListener(tabId => {
+      log(tabId, 'removed', {});
+      // let anyone following along read that much, then let it go
+      const l = logs.get(tabId);
+      if (!l) { return; }
+      l.closed = true;
+      l.timer = setTimeout(() => { if (logs.get(tabId) === l) { logs.delete(tabId); } }, 60 * 1000);
+    });
+  }
+  return { listen, log };
 })();
 Routes["/windows/#WINDOW_ID/create"] = {
     async write({windowId, buf}) {
@@ -485,7 +1325,7 @@ Routes["/tabs/by-id/#TAB_ID/window"] = {
   description: `The window that this tab lives in;
 a symbolic link to the folder /windows/[id for this window].`,
   async readlink({tabId}) {
-    const tab = await browser.tabs.get(tabId);
+    const tab = await TabIndex.tab(tabId);
     return { buf: "../../../windows/" + tab.windowId };
   }
 };
@@ -520,40 +1360,6 @@ see https://developer.chrome.com/extensions/tabs.`,
       else { resolve(); }
     }));
   }
-  const TabManager = (function() {
-    if (chrome.debugger) chrome.debugger.onEvent.addListener((source, method, params) => {
-      console.log(source, method, params);
-      if (method === "Page.frameStartedLoading") {
-        // we're gonna assume we're always plugged into both Page and Debugger.
-        TabManager.scriptsForTab[source.tabId] = {};
-
-      } else if (method === "Debugger.scriptParsed") {
-        TabManager.scriptsForTab[source.tabId] = TabManager.scriptsForTab[source.tabId] || {};
-        TabManager.scriptsForTab[source.tabId][params.scriptId] = params;
-      }
-    });
-
-    return {
-      scriptsForTab: {},
-      debugTab: async function(tabId) {
-        // meant to be higher-level wrapper for raw attach/detach
-        // TODO: could we remember if we're already attached? idk if it's worth it
-        try { await attachDebugger(tabId); }
-        catch (e) {
-          if (e.message.indexOf('Another debugger is already attached') !== -1) {
-            await detachDebugger(tabId);
-            await attachDebugger(tabId);
-          }
-        }
-        // TODO: detach automatically? some kind of reference counting thing?
-      },
-      enableDomainForTab: async function(tabId, domain) {
-        // TODO: could we remember if we're already enabled? idk if it's worth it
-        if (domain === 'Debugger') { TabManager.scriptsForTab[tabId] = {}; }
-        await sendDebuggerCommand(tabId, `${domain}.enable`, {});
-      }
-    };
-  })();
   function sendDebuggerCommand(tabId, method, commandParams) {
     return new Promise((resolve, reject) =>
       chrome.debugger.sendCommand({tabId}, method, commandParams, result => {
@@ -562,104 +1368,277 @@ see https://developer.chrome.com/extensions/tabs.`,
     );
   }
 
+  // One debugger session per tab, shared by everything under
+  // debugger/. It attaches the first time you touch it, enables each
+  // domain once, and detaches once nobody's used it for IDLE_MS (the
+  // browser shows its "started debugging" bar for as long as we're
+  // attached). While it's attached, it follows the tab's scripts and
+  // resources from events, so we don't have to keep asking.
+  const Sessions = {
+    byTab: new Map(), // tabId -> {attached, domains, users, idleTimer, scripts, resources, contents}
+    IDLE_MS: 30 * 1000,
+
+    get(tabId) {
+      let session = this.byTab.get(tabId);
+      if (session) { return session; }
+      session = { tabId, users: 0, idleTimer: null, domains: new Map(),
+                  scripts: {}, resources: new Map(), indexed: null,
+                  contents: new Map(), contentsBytes: 0 };
+      session.attached = (async () => {
+        try { await attachDebugger(tabId); }
+        catch (e) {
+          // (probably still us, from before the extension reloaded)
+          if (e.message.indexOf('Another debugger is already attached') === -1) { throw e; }
+          await detachDebugger(tabId);
+          await attachDebugger(tabId);
+        }
+      })();
+      session.attached.catch(() => this.drop(session));
+      this.byTab.set(tabId, session);
+      return session;
+    },
+    // Runs fn(session) with the debugger attached and domains enabled,
+    // and keeps it attached at least until fn is done.
+    async use(tabId, domains, fn) {
+      const session = this.get(tabId);
+      session.users++;
+      clearTimeout(session.idleTimer);
+      try {
+        await session.attached;
+        await Promise.all(domains.map(domain => this.enable(session, domain)));
+        return await fn(session);
+      } finally {
+        if (--session.users === 0 && this.byTab.get(tabId) === session) {
+          session.idleTimer = setTimeout(() => this.detach(session), this.IDLE_MS);
+        }
+      }
+    },
+    enable(session, domain) {
+      if (!session.domains.has(domain)) {
+        const enabled = sendDebuggerCommand(session.tabId, `${domain}.enable`, {});
+        // (so the next use tries again)
+        enabled.catch(() => session.domains.delete(domain));
+        session.domains.set(domain, enabled);
+      }
+      return session.domains.get(domain);
+    },
+    async detach(session) {
+      if (session.users > 0 || !this.drop(session)) { return; }
+      try { await detachDebugger(session.tabId); } catch (e) {}
+    },
+    // Forgets session (it's detached, or about to be). Everything we
+    // knew from its events goes with it, since we won't hear about
+    // changes anymore.
+    drop(session) {
+      if (this.byTab.get(session.tabId) !== session) { return false; }
+      clearTimeout(session.idleTimer);
+      this.byTab.delete(session.tabId);
+      return true;
+    }
+  };
+
+  // Each tab's resources, by file name (name -> {frameId, loaderId,
+  // url}), for every frame, not just the top one. We get the frame
+  // tree once per session, then keep it up to date: responses that
+  // come in add their resources, and frames that navigate or go away
+  // take theirs with them.
+  const RESOURCE_TYPES = new Set(['Stylesheet', 'Image', 'Media', 'Font', 'Script',
+                                  'TextTrack', 'Manifest']);
+  function addResource(session, frameId, loaderId, url) {
+    const name = sanitize(String(url));
+    // (first one wins, if two frames load the same URL)
+    if (!session.resources.has(name)) { session.resources.set(name, {frameId, loaderId, url}); }
+  }
+  function dropFrame(session, frameId) {
+    for (let [name, resource] of session.resources) {
+      if (resource.frameId !== frameId) { continue; }
+      session.resources.delete(name);
+      forgetContent(session, name);
+    }
+  }
+  function indexResources(session) {
+    if (!session.indexed) {
+      session.indexed = (async () => {
+        const {frameTree} = await sendDebuggerCommand(session.tabId, "Page.getResourceTree", {});
+        (function walk({frame, resources, childFrames = []}) {
+          for (let resource of resources) { addResource(session, frame.id, frame.loaderId, resource.url); }
+          childFrames.forEach(walk);
+        })(frameTree);
+      })();
+      session.indexed.catch(() => { session.indexed = null; });
+    }
+    return session.indexed;
+  }
+  function resourceNamed(session, name) {
+    const resource = session.resources.get(name);
+    if (!resource) { throw new UnixError(unix.ENOENT); }
+    return resource;
+  }
+
+  // What getResourceContent gave us, by file name, until that
+  // resource's frame navigates. Least recently used goes first, past
+  // CONTENTS_BUDGET per tab.
+  const CONTENTS_BUDGET = 16 * 1024 * 1024;
+  function resourceContent(session, name) {
+    let entry = session.contents.get(name);
+    if (entry) {
+      session.contents.delete(name); session.contents.set(name, entry);
+      return entry.data;
+    }
+    const {frameId, url} = resourceNamed(session, name);
+    entry = { size: 0, data: (async () => {
+      const {base64Encoded, content} = await sendDebuggerCommand(session.tabId, "Page.getResourceContent", {frameId, url});
+      if (base64Encoded) { return Uint8Array.from(atob(content), c => c.charCodeAt(0)); }
+      return content;
+    })() };
+    session.contents.set(name, entry);
+    entry.data.then(data => {
+      if (session.contents.get(name) !== entry) { return; }
+      entry.size = data.length;
+      session.contentsBytes += entry.size;
+      for (let oldest of session.contents.keys()) {
+        if (session.contentsBytes <= CONTENTS_BUDGET) { break; }
+        forgetContent(session, oldest);
+      }
+    }, () => forgetContent(session, name));
+    return entry.data;
+  }
+  function forgetContent(session, name) {
+    const entry = session.contents.get(name);
+    if (!entry) { return; }
+    session.contentsBytes -= entry.size;
+    session.contents.delete(name);
+  }
+
+  // how many times we've set each script's source, by tab (these
+  // outlast the session, since V8 keeps the edits)
+  const scriptEdits = new Map(); // tabId -> Map(scriptId -> edit)
+  let edits = 0;
+
+  chrome.debugger.onEvent.addListener((source, method, params) => {
+    const session = Sessions.byTab.get(source.tabId);
+    if (!session) { return; }
+    if (method === "Page.frameNavigated") {
+      // a new page means new scripts, too
+      if (!params.frame.parentId) { session.scripts = {}; }
+      dropFrame(session, params.frame.id);
+
+    } else if (method === "Page.frameDetached") {
+      dropFrame(session, params.frameId);
+
+    } else if (method === "Network.responseReceived") {
+      if (session.indexed && params.frameId && RESOURCE_TYPES.has(params.type)) {
+        addResource(session, params.frameId, params.loaderId, params.response.url);
+      }
+
+    } else if (method === "Debugger.scriptParsed") {
+      session.scripts[params.scriptId] = params;
+    }
+  });
+  chrome.debugger.onDetach.addListener((source, reason) => {
+    const session = Sessions.byTab.get(source.tabId);
+    if (session) { Sessions.drop(session); }
+    if (reason === 'target_closed') { scriptEdits.delete(source.tabId); }
+  });
+
   // possible idea: console (using Log API instead of monkey-patching)
   // resources/
   // TODO: scripts/ TODO: allow creation, eval immediately
 
   Routes["/tabs/by-id/#TAB_ID/debugger/resources"] = {
     async readdir({tabId}) {
-      await TabManager.debugTab(tabId); await TabManager.enableDomainForTab(tabId, "Page");
-      const {frameTree} = await sendDebuggerCommand(tabId, "Page.getResourceTree", {});
-      return { entries: [".", "..", ...frameTree.resources.map(r => sanitize(String(r.url)))] };
+      return Sessions.use(tabId, ["Page", "Network"], async session => {
+        await indexResources(session);
+        return { entries: [".", "..", ...session.resources.keys()] };
+      });
     }
   };
-  Routes["/tabs/by-id/#TAB_ID/debugger/resources/:SUFFIX"] = makeRouteWithContents(async ({path, tabId, suffix}) => {
-    await TabManager.debugTab(tabId); await TabManager.enableDomainForTab(tabId, "Page");
-
-    const {frameTree} = await sendDebuggerCommand(tabId, "Page.getResourceTree", {});
-    for (let resource of frameTree.resources) {
-      const resourceSuffix = sanitize(String(resource.url));
-      if (resourceSuffix === suffix) {
-        let {base64Encoded, content} = await sendDebuggerCommand(tabId, "Page.getResourceContent", {
-          frameId: frameTree.frame.id,
-          url: resource.url
-        });
-        if (base64Encoded) { return Uint8Array.from(atob(content), c => c.charCodeAt(0)); }
-        return content;
-      }
-    }
-    throw new UnixError(unix.ENOENT);
-  });
+  Routes["/tabs/by-id/#TAB_ID/debugger/resources/:SUFFIX"] = makeRouteWithContents(({tabId, suffix}) =>
+    Sessions.use(tabId, ["Page", "Network"], async session => {
+      await indexResources(session);
+      return resourceContent(session, suffix);
+    }), null, {
+      // a resource is the same until its frame loads something else
+      version: ({tabId, suffix}) => Sessions.use(tabId, ["Page", "Network"], async session => {
+        await indexResources(session);
+        return resourceNamed(session, suffix).loaderId;
+      })
+    });
+
   Routes["/tabs/by-id/#TAB_ID/debugger/scripts"] = {
-    async opendir({tabId}) {
-      await TabManager.debugTab(tabId); await TabManager.enableDomainForTab(tabId, "Debugger");
-      return { fh: 0 };
-    },
     async readdir({tabId}) {
       // it's useful to put the ID first in the script filenames, so
       // the .js extension stays on the end
-      const scriptFileNames = Object.values(TabManager.scriptsForTab[tabId])
-            .map(params => params.scriptId + "_" + sanitize(params.url));
-      return { entries: [".", "..", ...scriptFileNames] };
+      return Sessions.use(tabId, ["Debugger"], async session => {
+        const scriptFileNames = Object.values(session.scripts)
+              .map(params => params.scriptId + "_" + sanitize(params.url));
+        return { entries: [".", "..", ...scriptFileNames] };
+      });
     }
   };
-  function pathScriptInfo(tabId, filename) {
+  function pathScriptInfo(session, filename) {
     const [scriptId, ...rest] = filename.split("_");
-    const scriptInfo = TabManager.scriptsForTab[tabId][scriptId];
+    const scriptInfo = session.scripts[scriptId];
     if (!scriptInfo || sanitize(scriptInfo.url) !== rest.join("_")) {
       throw new UnixError(unix.ENOENT);
     }
     return scriptInfo;
   }
-  Routes["/tabs/by-id/#TAB_ID/debugger/scripts/:FILENAME"] = makeRouteWithContents(async ({tabId, filename}) => {
-    await TabManager.debugTab(tabId);
-    await TabManager.enableDomainForTab(tabId, "Page");
-    await TabManager.enableDomainForTab(tabId, "Debugger");
-
-    const {scriptId} = pathScriptInfo(tabId, filename);
-    const {scriptSource} = await sendDebuggerCommand(tabId, "Debugger.getScriptSource", {scriptId});
-    return scriptSource;
-
-  }, async ({tabId, filename}, buf) => {
-    await TabManager.debugTab(tabId); await TabManager.enableDomainForTab(tabId, "Debugger");
-
-    const {scriptId} = pathScriptInfo(tabId, filename);
-    await sendDebuggerCommand(tabId, "Debugger.setScriptSource", {scriptId, scriptSource: buf});
-  });
+  Routes["/tabs/by-id/#TAB_ID/debugger/scripts/:FILENAME"] = makeRouteWithContents(({tabId, filename}) =>
+    Sessions.use(tabId, ["Page", "Debugger"], async session => {
+      const {scriptId} = pathScriptInfo(session, filename);
+      const {scriptSource} = await sendDebuggerCommand(tabId, "Debugger.getScriptSource", {scriptId});
+      return scriptSource;
+    }),
+  ({tabId, filename}, buf) =>
+    Sessions.use(tabId, ["Page", "Debugger"], async session => {
+      const {scriptId} = pathScriptInfo(session, filename);
+      await sendDebuggerCommand(tabId, "Debugger.setScriptSource", {scriptId, scriptSource: buf});
+      if (!scriptEdits.has(tabId)) { scriptEdits.set(tabId, new Map()); }
+      scriptEdits.get(tabId).set(scriptId, ++edits);
+    }), {
+      // hash is V8's hash of the source it parsed, which doesn't change
+      // when we set the source, so count our edits too
+      version: ({tabId, filename}) => Sessions.use(tabId, ["Page", "Debugger"], async session => {
+        const {scriptId, hash} = pathScriptInfo(session, filename);
+        return hash + "." + ((scriptEdits.get(tabId) || new Map()).get(scriptId) || 0);
+      })
+    });
 })();
 
 Routes["/tabs/by-id/#TAB_ID/inputs"] = {
   description: `Contains a file for each text input and textarea on this page (as long as it has an ID, currently).`,
   async readdir({tabId}) {
-    // TODO: assign new IDs to inputs without them?
-    const code = `Array.from(document.querySelectorAll('textarea, input[type=text]'))
-                    .map(e => e.id).filter(id => id)`;
-    const ids = (await browser.tabs.executeScript(tabId, {code}))[0];
+    const ids = await Agents.call(tabId, 'inputs');
     return { entries: [".", "..", ...ids.map(id => `${id}.txt`)] };
   }
 };
 Routes["/tabs/by-id/#TAB_ID/inputs/:INPUT_ID.txt"] = makeRouteWithContents(async ({tabId, inputId}) => {
-  const code = `document.getElementById('${inputId}').value`;
-  const inputValue = (await browser.tabs.executeScript(tabId, {code}))[0];
+  const inputValue = await Agents.call(tabId, 'getInput', {id: inputId});
   if (inputValue === null) { throw new UnixError(unix.ENOENT); } /* FIXME: hack to deal with if inputId isn't valid */
   return inputValue;
 
 }, async ({tabId, inputId}, buf) => {
-  const code = `document.getElementById('${inputId}').value = unescape('${escape(buf)}')`;
-  await browser.tabs.executeScript(tabId, {code});
+  await Agents.call(tabId, 'setInput', {id: inputId, value: buf});
 });
 
 Routes["/windows"] = {
   async readdir() {
-    const windows = await browser.windows.getAll();
-    return { entries: [".", "..", ...windows.map(window => String(window.id))] };
+    const windows = await TabIndex.windows();
+    return {
+      entries: [".", "..", ...windows.map(window => String(window.id))],
+      attrs: [null, null, ...windows.map(window => attrsForDirectory())]
+    };
   }
 };
 
 Routes["/windows/#WINDOW_ID/tabs"] = {
   async readdir({windowId}) {
-    const tabs = await browser.tabs.query({windowId});
-    return { entries: [".", "..", ...tabs.map(tab => sanitize(String(tab.title) + "." + String(tab.id))) ] }
+    const tabs = await TabIndex.entriesInWindow(windowId);
+    return {
+      entries: [".", "..", ...tabs.map(({inWindow}) => inWindow)],
+      attrs: [null, null, ...tabs.map(({tab}) => attrsForSymlink("../../../tabs/by-id/" + tab.id))]
+    };
   }
 }
 
@@ -676,14 +1655,14 @@ Routes["/windows/#WINDOW_ID/tabs/:TAB_TITLE.#TAB_ID"] = {
 Routes["/windows/last-focused"] = {
   description: `A symbolic link to /windows/[id for the last focused window].`,
   async readlink() {
-    const windowId = (await browser.windows.getLastFocused()).id;
-    return { buf: windowId };
+    const windowId = await TabIndex.lastFocusedWindowId();
+    return { buf: String(windowId) };
   }
 };
 
 (function() {
   const withWindow = (readHandler, writeHandler) => makeRouteWithContents(async ({windowId}) => {
-    const window = await browser.windows.get(windowId);
+    const window = await TabIndex.window(windowId);
     return readHandler(window);
 
   }, writeHandler ? async ({windowId}, buf) => {
@@ -694,27 +1673,41 @@ Routes["/windows/last-focused"] = {
     withWindow(window => JSON.stringify(window.focused) + '\n',
                buf => ({ focused: buf.startsWith('true') }));
 })();
-Routes["/windows/#WINDOW_ID/visible-tab.png"] = { ...makeRouteWithContents(async ({windowId}) => {
+(function() {
   // screen capture is a window thing and not a tab thing because you
   // can only capture the visible tab for each window anyway; you
   // can't take a screenshot of just any arbitrary tab
-  const dataUrl = await browser.tabs.captureVisibleTab(windowId, {format: 'png'});
-  return Uint8Array.from(atob(dataUrl.substr(("data:image/png;base64,").length)),
-                         c => c.charCodeAt(0));
-
-}), async getattr() {
-  return {
-    st_mode: unix.S_IFREG | 0444,
-    st_nlink: 1,
-    st_size: 10000000 // hard-code to 10MB for now
+  //
+  // the data URL we get back is already base64, so we keep it that
+  // way (see Base64Contents). makeRouteWithContents's cache means a
+  // getattr (for the real st_size) and the open after it share one
+  // capture, and so does anyone else who asks for the same window in
+  // the same format within that second; a new active tab or a page
+  // load in the active tab throws it out early (see
+  // listenForInvalidations).
+  const capture = (format, defaultQuality) => async ({windowId, quality = defaultQuality}) => {
+    if (quality !== undefined) {
+      quality = parseInt(quality);
+      if (!(quality >= 0 && quality <= 100)) { throw new UnixError(unix.ENOENT); }
+    }
+    const dataUrl = await browser.tabs.captureVisibleTab(windowId, {format, quality});
+    return new Base64Contents(dataUrl.substr(dataUrl.indexOf(',') + 1));
   };
-} };
-
+  // (captures are slow, and they wait for the window to be painted)
+  const timeout = 5000;
+  Routes["/windows/#WINDOW_ID/visible-tab.png"] = { ...makeRouteWithContents(capture('png')), timeout };
+  Routes["/windows/#WINDOW_ID/visible-tab.jpg"] = { ...makeRouteWithContents(capture('jpeg')), timeout };
+  // any other JPEG quality, 0-100: visible-tab.q50.jpg
+  Routes["/windows/#WINDOW_ID/visible-tab.q#QUALITY.jpg"] = { ...makeRouteWithContents(capture('jpeg')), timeout };
+})();
 
 Routes["/extensions"] = {  
   async readdir() {
     const infos = await browser.management.getAll();
-    return { entries: [".", "..", ...infos.map(info => `${sanitize(info.name)}.${info.id}`)] };
+    return {
+      entries: [".", "..", ...infos.map(info => `${sanitize(info.name)}.${info.id}`)],
+      attrs: [null, null, ...infos.map(info => attrsForDirectory())]
+    };
   }
 };
 Routes["/extensions/:EXTENSION_TITLE.:EXTENSION_ID/enabled"] = { ...makeRouteWithContents(async ({extensionId}) => {
@@ -735,8 +1728,21 @@ Routes["/runtime/reload"] = {
   truncate() { return {}; }
 };
 
-window.fetch(chrome.runtime.getURL('background.js'))
-  .then(async r => { window.__backgroundJS = await r.text(); });
+Routes["/runtime/cache.json"] = {
+  description: `How much file contents the extension is holding on to for open
+files (and for getattrs and opens that come in right after each other),
+and how often that saved going back to the browser.`,
+  usage: 'cat $0',
+  ...makeRouteWithContents(() => JSON.stringify({
+    handles: makeRouteWithContents.Cache,
+    contents: makeRouteWithContents.ContentCache
+  }, null, 2) + '\n', undefined, {cache: 0})
+};
+
+if (chrome.runtime) { // (not in node)
+  window.fetch(chrome.runtime.getURL('background.js'))
+    .then(async r => { window.__backgroundJS = await r.text(); });
+}
 
 Routes["/runtime/routes.html"] = makeRouteWithContents(async () => {
   if (!window.__backgroundJS) throw new UnixError(unix.EIO);
@@ -815,60 +1821,124 @@ Routes["/runtime/routes.html"] = makeRouteWithContents(async () => {
 `;
 });
 
-// Ensure that there are routes for all ancestors. This algorithm is
-// probably not correct, but whatever. Basically, you need to start at
-// the deepest level, fill in all the parents 1 level up that don't
-// exist yet, then walk up one level at a time. It's important to go
-// one level at a time so you know (for each parent) what all the
-// children will be.
-for (let i = 10; i >= 0; i--) {
-  for (let path of Object.keys(Routes).filter(key => key.split("/").length === i)) {
-    path = path.substr(0, path.lastIndexOf("/"));
-    if (path == '') path = '/';
-
-    if (!Routes[path]) { Routes[path] = makeDefaultRouteForDirectory(path); }
-  }
-  // I also think it would be better to compute this stuff on the fly,
-  // so you could patch more routes in at runtime, but I need to think
-  // a bit about how to make that work with wildcards.
+// Routes get compiled into a trie with one level per path segment, so
+// matching a path is a walk down the trie instead of running every
+// route's regex in turn. Each trie node has
+//
+// - literals: children for plain segments like `by-id`, by name
+// - patterns: children for segments with variables in them, like
+//   `#TAB_ID` or `:TAB_TITLE.#TAB_ID`, each with a precompiled matcher
+// - route: the route for the path that ends here, if there is one
+// - depths: bit d is set if some route ends d segments below here, so
+//   a walk can skip subtrees with nothing the length of its path
+//   (routes are never 30 segments deep)
+//
+// As before, if more than one route matches a path, the one with the
+// fewest variables wins (and then the one that was defined first).
+function makeTrieNode() {
+  return { literals: new Map(), patterns: new Map(), route: null, order: 0, varCount: 0, depths: 0 };
 }
+const routeTrie = makeTrieNode();
+let nextRouteOrder = 0;
+
+function compileSegment(keySegment) {
+  // `:TAB_TITLE.#TAB_ID` -> [{name: 'tabTitle'}, '.', {name: 'tabId', int: true}]
+  const parts = [];
+  let last = 0;
+  for (let m of keySegment.matchAll(/([#:])([A-Z_]+)/g)) {
+    if (m.index > last) { parts.push(keySegment.substring(last, m.index)); }
+    // TAB_ID -> tabId
+    const name = m[2].toLowerCase().replace(/_([a-z])/g, c => c[1].toUpperCase());
+    parts.push({ name, int: m[1] === '#' });
+    last = m.index + m[0].length;
+  }
+  if (last < keySegment.length) { parts.push(keySegment.substring(last)); }
 
+  const varCount = parts.filter(part => typeof part !== 'string').length;
+  if (varCount === 0) { return null; }
 
-for (let key in Routes) {
-  // /tabs/by-id/#TAB_ID/url.txt -> RegExp \/tabs\/by-id\/(?<int$TAB_ID>[0-9]+)\/url.txt
-  Routes[key].__matchVarCount = 0;
-  Routes[key].__regex = new RegExp(
-    '^' + key
-      .split('/')
-      .map(keySegment => keySegment
-           .replace(/[.*+?^${}()|[\]\\]/g, '\\$&')
-           .replace(/([#:])([A-Z_]+)/g, (_, sigil, varName) => {
-             Routes[key].__matchVarCount++;
-             return `(?<${sigil === '#' ? 'int$' : 'string$'}${varName}>` +
-                         (sigil === '#' ? '[0-9]+' : '[^/]+') + `)`;
-           }))
-      .join('/') + '$');
-
-  Routes[key].__match = function(path) {
-    const result = Routes[key].__regex.exec(path);
-    if (!result) { return; }
-
-    const vars = {};
-    for (let [typeAndVarName, value] of Object.entries(result.groups || {})) {
-      let [type_, varName] = typeAndVarName.split('$');
-      // TAB_ID -> tabId
-      varName = varName.toLowerCase();
-      varName = varName.replace(/_([a-z])/g, c => c[1].toUpperCase());
-      vars[varName] = type_ === 'int' ? parseInt(value) : value;
+  const isDigit = c => c >= 48 && c <= 57;
+  function matchFrom(i, seg, pos, vars) {
+    if (i === parts.length) { return pos === seg.length; }
+    const part = parts[i];
+    if (typeof part === 'string') {
+      return seg.startsWith(part, pos) && matchFrom(i + 1, seg, pos + part.length, vars);
     }
-    return vars;
-  };
+    // variables are greedy (like the [0-9]+ and [^/]+ regexes they
+    // replaced), so `a.b.12` against `:TITLE.#ID` gives title `a.b`
+    let end = seg.length;
+    if (part.int) {
+      end = pos;
+      while (end < seg.length && isDigit(seg.charCodeAt(end))) { end++; }
+    }
+    for (; end > pos; end--) {
+      if (matchFrom(i + 1, seg, end, vars)) {
+        const value = seg.substring(pos, end);
+        vars[part.name] = part.int ? parseInt(value) : value;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  let match;
+  if (parts.length === 1 && parts[0].int) {
+    const {name} = parts[0];
+    match = seg => {
+      if (seg.length === 0) { return; }
+      for (let i = 0; i < seg.length; i++) { if (!isDigit(seg.charCodeAt(i))) { return; } }
+      return { [name]: parseInt(seg) };
+    };
+  } else if (parts.length === 1) {
+    const {name} = parts[0];
+    match = seg => seg.length > 0 ? { [name]: seg } : undefined;
+  } else {
+    match = seg => { const vars = {}; if (matchFrom(0, seg, 0, vars)) { return vars; } };
+  }
+  return { match, varCount };
+}
 
-  // Fill in default implementations of fs ops:
+function keySegments(key) { return key === '/' ? [] : key.substr(1).split('/'); }
+
+function trieNodeForKey(key, along = []) {
+  let node = routeTrie;
+  along.push(node);
+  for (let keySegment of keySegments(key)) {
+    let child = node.literals.get(keySegment) ||
+        (node.patterns.get(keySegment) || {}).node;
+    if (!child) {
+      child = makeTrieNode();
+      const pattern = compileSegment(keySegment);
+      child.varCount = node.varCount + (pattern ? pattern.varCount : 0);
+      if (pattern) {
+        node.patterns.set(keySegment, { ...pattern, node: child });
+        // try fewer-variable segments first
+        node.patterns = new Map([...node.patterns].sort(([, a], [, b]) => a.varCount - b.varCount));
+      } else {
+        node.literals.set(keySegment, child);
+      }
+    }
+    node = child;
+    along.push(node);
+  }
+  return node;
+}
+// after the route at key comes or goes, fix depths on the way back up
+function updateTrieDepths(along) {
+  for (let i = along.length - 1; i >= 0; i--) {
+    const node = along[i];
+    let depths = node.route ? 1 : 0;
+    for (let child of node.literals.values()) { depths |= child.depths << 1; }
+    for (let {node: child} of node.patterns.values()) { depths |= child.depths << 1; }
+    node.depths = depths;
+  }
+}
 
+// Fill in default implementations of fs ops.
+function withDefaultOps(route) {
   // if readdir -> directory -> add getattr, opendir, releasedir
-  if (Routes[key].readdir) {
-    Routes[key] = {
+  if (route.readdir) {
+    return {
       getattr() { 
         return {
           st_mode: unix.S_IFDIR | 0755,
@@ -878,11 +1948,11 @@ for (let key in Routes) {
       },
       opendir({path}) { return { fh: 0 }; },
       releasedir({path}) { return {}; },
-      ...Routes[key]
+      ...route
     };
 
-  } else if (Routes[key].readlink) {
-    Routes[key] = {
+  } else if (route.readlink) {
+    return {
       async getattr(req) {
         const st_size = (await this.readlink(req)).buf.length + 1;
         return {
@@ -892,66 +1962,212 @@ for (let key in Routes) {
           st_size
         };
       },
-      ...Routes[key]
+      ...route
     };
     
-  } else if (Routes[key].read || Routes[key].write) {
-    Routes[key] = {
+  } else if (route.read || route.write) {
+    return {
       async getattr() {
         return {
-          st_mode: unix.S_IFREG | ((Routes[key].read && 0444) | (Routes[key].write && 0222)),
+          st_mode: unix.S_IFREG | ((route.read && 0444) | (route.write && 0222)),
           st_nlink: 1,
           st_size: 100 // FIXME
         };
       },
       open() { return { fh: 0 }; },
+      flush() { return {}; },
+      fsync() { return {}; },
       release() { return {}; },
-      ...Routes[key]
+      // (tabfs hears about changes anyway, from invalidate())
+      poll() { return {}; },
+      ...route
     };
   }
+  return route;
+}
+
+// Puts route at key (in Routes and in the trie), and makes sure all
+// its ancestors exist as directories.
+const routeTable = Routes;
+function addRoute(key, route) {
+  route = withDefaultOps(route);
+  routeTable[key] = route;
+
+  const along = [];
+  const node = trieNodeForKey(key, along);
+  if (!node.route) { node.order = nextRouteOrder++; }
+  node.route = route;
+  updateTrieDepths(along);
+
+  if (key !== '/') {
+    let parent = key.substr(0, key.lastIndexOf('/'));
+    if (parent === '') parent = '/';
+    if (!routeTable[parent]) { addRoute(parent, makeDefaultRouteForDirectory(parent)); }
+  }
+}
+for (let key in Routes) { addRoute(key, Routes[key]); }
+
+// From here on, anything that patches Routes (like a hot reload) goes
+// straight into the trie too.
+window.Routes = new Proxy(routeTable, {
+  set(target, key, route) { addRoute(key, route); return true; },
+  deleteProperty(target, key) {
+    const along = [];
+    trieNodeForKey(key, along).route = null;
+    updateTrieDepths(along);
+    delete target[key];
+    return true;
+  }
+});
+
+// Depth-first, literal children before patterns, keeping the best
+// route we've found so far in `best` (and skipping subtrees that can
+// only have worse ones, or none at all). `pos` is where the next
+// segment of path starts, and there are `left` segments from there;
+// segVars holds the variables from each pattern segment we went
+// through on the way down.
+function walkRouteTrie(node, path, pos, left, segVars, best) {
+  if (!(node.depths & (1 << left))) { return; }
+  if (left === 0) {
+    const b = best.node;
+    if (node.route && (!b || node.varCount < b.varCount ||
+                       (node.varCount === b.varCount && node.order < b.order))) {
+      best.node = node;
+      best.segVars = segVars.slice();
+    }
+    return;
+  }
+  let end = path.indexOf('/', pos);
+  if (end === -1) { end = path.length; }
+  const seg = path.substring(pos, end);
+
+  const literal = node.literals.get(seg);
+  if (literal) { walkRouteTrie(literal, path, end + 1, left - 1, segVars, best); }
+  for (let {match, node: child} of node.patterns.values()) {
+    if (best.node && child.varCount > best.node.varCount) { break; } // sorted by varCount
+    const vars = match(seg);
+    if (vars) {
+      segVars.push(vars);
+      walkRouteTrie(child, path, end + 1, left - 1, segVars, best);
+      segVars.pop();
+    }
+  }
 }
 
-// most specific (lowest matchVarCount) routes should match first
-const sortedRoutes = Object.values(Routes).sort((a, b) =>
-  a.__matchVarCount - b.__matchVarCount
-);
+// Misses are common (ls, shells and editors all look for files that
+// aren't there) and their stack traces say nothing, so they all throw
+// the same error instead of paying for a new one each time.
+const noRoute = Object.freeze(new UnixError(unix.ENOENT));
+const appleDouble = Object.freeze(new UnixError(unix.ENOTSUP));
 function tryMatchRoute(path) {
-  if (path.match(/\/\._[^\/]+$/)) {
+  const lastSeg = path.lastIndexOf('/') + 1;
+  if (path.length > lastSeg + 2 && path.startsWith('._', lastSeg)) {
     // Apple Double ._whatever file for xattrs
-    throw new UnixError(unix.ENOTSUP); 
+    throw appleDouble;
   }
 
-  for (let route of sortedRoutes) {
-    const vars = route.__match(path);
-    if (vars) { return [route, vars]; }
+  let left = 0;
+  if (path !== '/') {
+    for (let i = 0; i < path.length; i++) { if (path.charCodeAt(i) === 47) { left++; } }
   }
-  throw new UnixError(unix.ENOENT);
+  const best = { node: null, segVars: [] };
+  if (left < 30) { walkRouteTrie(routeTrie, path, 1, left, [], best); }
+  if (best.node) {
+    return [best.node.route, best.segVars.length === 1 ? best.segVars[0] : Object.assign({}, ...best.segVars)];
+  }
+  throw noRoute;
 }
 
+// A response with a `buf` bigger than this goes out in several
+// messages, {id, op, buf: <part>, more: true} and then the rest of the
+// response with the last part, so tabfs can start decoding before
+// we've encoded all of it. Each part is a multiple of 3 bytes, so it's
+// base64 on its own. (768K of data = 1M of base64.)
+const MAX_BUF_PER_MESSAGE = 3 * 256 * 1024;
+
+async function bufToBase64(buf) {
+  return buf instanceof Uint8Array ? await utf8ArrayToBase64(buf) : btoa(buf);
+}
+// a read's buf, as base64 strings that each fit in a message
+async function* base64Parts(buf) {
+  if (buf.base64) {
+    // already base64 (from Base64Contents)
+    const MAX_BASE64_PER_MESSAGE = MAX_BUF_PER_MESSAGE / 3 * 4;
+    for (let part of buf.base64) {
+      for (let start = 0; start < part.length; start += MAX_BASE64_PER_MESSAGE) {
+        yield part.substring(start, start + MAX_BASE64_PER_MESSAGE);
+      }
+    }
+    return;
+  }
+  // (a route that hands back a number or something, like btoa() took)
+  if (typeof buf !== 'string' && !(buf instanceof Uint8Array)) { buf = String(buf); }
+  const slice = (start, end) => buf.subarray ? buf.subarray(start, end) : buf.slice(start, end);
+  for (let start = 0; start < buf.length; start += MAX_BUF_PER_MESSAGE) {
+    yield await bufToBase64(slice(start, start + MAX_BUF_PER_MESSAGE));
+  }
+}
+
+// How long a request gets before we give up on it and answer
+// ETIMEDOUT, in ms. A route can set its own `timeout`, either one
+// number or one per op (`timeout: {flush: 5000}`).
+const DEFAULT_TIMEOUT = 1000;
+function timeoutFor(route, op) {
+  const {timeout} = route;
+  if (typeof timeout === 'number') { return timeout; }
+  if (timeout && timeout[op] !== undefined) { return timeout[op]; }
+  return DEFAULT_TIMEOUT;
+}
+
+// Requests we haven't answered yet, by id. tabfs sends {op: 'cancel',
+// id} when whoever asked isn't waiting anymore (they hit Ctrl-C, or
+// tabfs gave up on us), and then we don't answer at all. Handlers get
+// the AbortSignal as `signal` if there's anything they can stop.
+const inFlight = new Map(); // id -> AbortController
+
 let port;
 async function onMessage(req) {
+  if (req.op === 'cancel') {
+    const controller = inFlight.get(req.id);
+    if (controller) { console.log('cancel', req.id); controller.abort(); }
+    return;
+  }
   if (req.buf) req.buf = atob(req.buf);
   console.log('req', req);
 
   let response = { op: req.op, error: unix.EIO };
-  let didTimeout = false, timeout = setTimeout(() => {
-    // timeout is very useful because some operations just hang
-    // (like trying to take a screenshot, until the tab is focused)
-    didTimeout = true; console.error('timeout');
-    port.postMessage({ id: req.id, op: req.op, error: unix.ETIMEDOUT });
-  }, 1000);
-
-  /* console.time(req.op + ':' + req.path);*/
+  const controller = new AbortController();
+  inFlight.set(req.id, controller);
+  let timeout;
+
+  // how long the handler took (from the browser's point of view), so
+  // tabfs can tell that apart from the time spent getting messages
+  // back and forth (see /.tabfs/stats)
+  const start = performance.now();
   try {
     const [route, vars] = tryMatchRoute(req.path);
-    response = await route[req.op]({...req, ...vars});
+    timeout = setTimeout(() => {
+      // timeout is very useful because some operations just hang
+      // (like trying to take a screenshot, until the tab is focused)
+      console.error('timeout');
+      controller.abort();
+      port.postMessage({ id: req.id, op: req.op, error: unix.ETIMEDOUT });
+    }, timeoutFor(route, req.op));
+
+    response = await route[req.op]({...req, ...vars, signal: controller.signal});
     response.op = req.op;
     if (response.buf) {
-      if (response.buf instanceof Uint8Array) {
-        response.buf = await utf8ArrayToBase64(response.buf);
-      } else {
-        response.buf = btoa(response.buf);
+      // send all but the last part ahead with `more`, so no one
+      // message goes over the 1MB limit
+      let last;
+      for await (let part of base64Parts(response.buf)) {
+        if (controller.signal.aborted) { break; }
+        if (last !== undefined) {
+          port.postMessage({ id: req.id, op: req.op, more: true, buf: last });
+        }
+        last = part;
       }
+      response.buf = last || '';
     }
 
   } catch (e) {
@@ -961,17 +2177,83 @@ async function onMessage(req) {
       error: e instanceof UnixError ? e.error : unix.EIO
     };
   }
-  /* console.timeEnd(req.op + ':' + req.path);*/
-
-  if (!didTimeout) {
-    clearTimeout(timeout);
+  response.browser_us = Math.round((performance.now() - start) * 1000);
+  clearTimeout(timeout);
+  inFlight.delete(req.id);
 
+  if (!controller.signal.aborted) {
     console.log('resp', response);
     response.id = req.id;
     port.postMessage(response);
   }
 };
 
+// tabfs caches attributes on its end (and we cache file contents on
+// ours), so tell it when something changes out from under it. each
+// path gets thrown out along with everything under it.
+function invalidate(...paths) {
+  for (let path of paths) {
+    makeRouteWithContents.ContentCache.invalidateTree(path);
+    makeRouteWithContents.Cache.invalidateTree(path);
+  }
+  if (port) { port.postMessage({ op: 'invalidate', paths }); }
+}
+function listenForInvalidations() {
+  // (first, so the index and event logs are up to date by the time
+  // tabfs comes back to ask about whatever we invalidated)
+  TabIndex.listen();
+  TabEvents.listen();
+  Agents.listen();
+
+  // title/URL changes rename entries in these listings (and change
+  // what's in /tabs/all)
+  const tabListings = windowId =>
+        ['/tabs/by-title', '/tabs/by-window', `/windows/${windowId}/tabs`, '/tabs/all'];
+
+  browser.tabs.onCreated.addListener(tab => {
+    invalidate(`/tabs/by-id/${tab.id}`, ...tabListings(tab.windowId));
+  });
+  browser.tabs.onUpdated.addListener((tabId, changeInfo, tab) => {
+    if (changeInfo.title || changeInfo.url) {
+      invalidate(`/tabs/by-id/${tabId}`, ...tabListings(tab.windowId));
+    } else {
+      invalidate(`/tabs/by-id/${tabId}`, ...(changeInfo.status === 'complete' ? ['/tabs/all'] : []));
+    }
+    // what the window's screenshot looks like
+    if (tab.active && changeInfo.status === 'complete') { invalidate(`/windows/${tab.windowId}`); }
+  });
+  browser.tabs.onRemoved.addListener((tabId, {windowId}) => {
+    invalidate(`/tabs/by-id/${tabId}`, ...tabListings(windowId));
+  });
+  browser.tabs.onActivated.addListener(({tabId, previousTabId, windowId}) => {
+    // active.txt changes for both tabs (previousTabId is Firefox-only,
+    // so in Chrome just throw out every tab's)
+    invalidate(...(previousTabId !== undefined
+                   ? [`/tabs/by-id/${tabId}`, `/tabs/by-id/${previousTabId}`]
+                   : ['/tabs/by-id']),
+               '/tabs/last-focused', `/windows/${windowId}`);
+  });
+  browser.tabs.onAttached.addListener((tabId, {newWindowId}) => {
+    invalidate(`/tabs/by-id/${tabId}`, ...tabListings(newWindowId));
+  });
+  browser.tabs.onDetached.addListener((tabId, {oldWindowId}) => {
+    invalidate(`/tabs/by-id/${tabId}`, ...tabListings(oldWindowId));
+  });
+  browser.tabs.onMoved.addListener(tabId => {
+    invalidate(`/tabs/by-id/${tabId}/events.jsonl`);
+  });
+  browser.windows.onCreated.addListener(window => {
+    invalidate(`/windows/${window.id}`);
+  });
+  browser.windows.onRemoved.addListener(windowId => {
+    invalidate(`/windows/${windowId}`);
+  });
+  browser.windows.onFocusChanged.addListener(() => {
+    // every window's focused file changes
+    invalidate('/windows', '/tabs/last-focused');
+  });
+}
+
 function tryConnect() {
   // Safari is very weird -- it has this native app that we have to talk to,
   // so we poke that app to wake it up, get it to start the TabFS process
@@ -1009,6 +2291,7 @@ function tryConnect() {
   port.onMessage.addListener(onMessage);
   port.onDisconnect.addListener(p => {
     console.log('disconnect', p);
+    disconnectListeners.forEach(fn => fn());
   });
 }
 
@@ -1016,9 +2299,11 @@ function tryConnect() {
 if (typeof process === 'object') {
   // we're running in node (as part of a test)
   // return everything they might want to test
-  module.exports = {Routes, tryMatchRoute}; 
+  module.exports = {Routes, tryMatchRoute, tryConnect, listenForInvalidations, TabIndex,
+                    makeRouteWithContents, jsonLinesForAllTabs, Agents, TabEvents};
 
 } else {
   tryConnect();
+  listenForInvalidations();
 }
 
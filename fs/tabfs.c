@@ -11,7 +11,24 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/mount.h>
+#endif
 
 #include <fuse.h>
 
@@ -20,274 +37,2662 @@
 
 #define eprintln(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
 
-// protects:
-// - writing to stdout
-// - the "waiters" global
-static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+// documented somewhere in https://developer.chrome.com/docs/apps/nativeMessaging/
+#define MAX_MESSAGE_SIZE (size_t)(1024*1024)
+
+// Biggest write we'll ask FUSE for (it won't go past 128K anyway). The
+// write request has the data in base64, so it's 4/3 this size plus a
+// little JSON, and it has to fit in one message to the browser.
+#define MAX_WRITE_SIZE 131072
+_Static_assert(MAX_WRITE_SIZE / 3 * 4 + 4096 < MAX_MESSAGE_SIZE,
+               "write requests wouldn't fit in a message");
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// Message buffers. Requests and responses are serialized into
+// buffers that get reused from op to op, so steady-state traffic
+// doesn't touch the allocator at all: each thread keeps one request
+// buffer and one spare response buffer, and the reader thread trades
+// its freshly filled buffer for the waiting thread's spare one.
+//
+// A msgbuf is a plain char * with its capacity stashed just before
+// it, so callers can keep passing (char *data, size_t size) around.
+struct msgbuf {
+    size_t cap;
+    char data[];
+};
+
+// counts every allocation that goes through msgbuf_reserve, so you
+// can check that it's flat under load
+static uint64_t msgbuf_allocs;
+
+static size_t msgbuf_cap(char *data) {
+    return data ? ((struct msgbuf *)(data - offsetof(struct msgbuf, data)))->cap : 0;
+}
+// Makes sure *datap can hold size bytes. Doesn't preserve contents.
+static void msgbuf_reserve(char **datap, size_t size) {
+    if (msgbuf_cap(*datap) >= size) return;
+
+    size_t cap = 4096;
+    while (cap < size) cap *= 2;
+
+    if (*datap) free(*datap - offsetof(struct msgbuf, data));
+    struct msgbuf *mb = malloc(sizeof(*mb) + cap);
+    if (mb == NULL) { perror("msgbuf"); exit(1); }
+    mb->cap = cap;
+    *datap = mb->data;
+    __atomic_fetch_add(&msgbuf_allocs, 1, __ATOMIC_RELAXED);
+}
+static void msgbuf_free(char *data) {
+    if (data) free(data - offsetof(struct msgbuf, data));
+}
+
+struct thread_bufs {
+    char *request;
+    char *spare_response;
+};
+static pthread_key_t thread_bufs_key;
+static pthread_once_t thread_bufs_once = PTHREAD_ONCE_INIT;
+
+static void thread_bufs_destroy(void *ud) {
+    struct thread_bufs *tb = ud;
+    msgbuf_free(tb->request);
+    msgbuf_free(tb->spare_response);
+    free(tb);
+}
+static void thread_bufs_init(void) {
+    pthread_key_create(&thread_bufs_key, thread_bufs_destroy);
+}
+static struct thread_bufs *thread_bufs(void) {
+    pthread_once(&thread_bufs_once, thread_bufs_init);
+    struct thread_bufs *tb = pthread_getspecific(thread_bufs_key);
+    if (tb == NULL) {
+        tb = calloc(1, sizeof(*tb));
+        pthread_setspecific(thread_bufs_key, tb);
+    }
+    return tb;
+}
+
+// Gives a response buffer back to this thread once the caller is done
+// with it.
+static void msgbuf_release(char *data) {
+    if (data == NULL) return;
+    struct thread_bufs *tb = thread_bufs();
+    if (tb->spare_response == NULL) {
+        tb->spare_response = data;
+    } else {
+        // keep whichever is bigger, so we converge on one buffer
+        // big enough for this thread's usual responses
+        if (msgbuf_cap(data) > msgbuf_cap(tb->spare_response)) {
+            char *tmp = tb->spare_response;
+            tb->spare_response = data;
+            data = tmp;
+        }
+        msgbuf_free(data);
+    }
+}
 
-struct resumedata {
-    unsigned int id;
-    int msgpipe[2];
-    void *data;
+// Responses. The reader thread walks each message exactly once and
+// notes where each top-level key's value is, so the waiting thread
+// never has to re-scan it (and the big base64 `buf` string only gets
+// touched once more, when it's decoded).
+//
+// This isn't a general JSON parser; it only knows what the extension
+// sends, which is one flat object. Values come out as json_tokens,
+// like frozen's %T would give you: strings without their quotes,
+// arrays and objects whole.
+#define MAX_RESPONSE_FIELDS 16
+struct response {
+    char *data;
     size_t size;
+
+    int has_id;
+    uint64_t id;
+    int has_error;
+    int error;
+
+    int num_fields;
+    struct response_field {
+        const char *key;
+        size_t key_len;
+        struct json_token value;
+    } fields[MAX_RESPONSE_FIELDS];
+};
+
+static void response_free(struct response *resp) {
+    msgbuf_release(resp->data);
+    resp->data = NULL;
+}
+
+static const char *skip_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+// p points at an opening quote. Returns just past the closing quote.
+static const char *skip_string(const char *p, const char *end) {
+    p++;
+    for (;;) {
+        // memchr is much faster than stepping through a megabyte of
+        // base64 one char at a time
+        const char *q = memchr(p, '"', end - p);
+        if (q == NULL) return NULL;
+        // the quote is escaped iff an odd number of backslashes precede it
+        const char *r = q;
+        while (r > p && r[-1] == '\\') r--;
+        if ((q - r) % 2 == 0) return q + 1;
+        p = q + 1;
+    }
+}
+static const char *skip_value(const char *p, const char *end) {
+    if (p >= end) return NULL;
+    if (*p == '"') return skip_string(p, end);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                p = skip_string(p, end);
+                if (p == NULL) return NULL;
+                continue;
+            }
+            if (*p == '{' || *p == '[') depth++;
+            else if ((*p == '}' || *p == ']') && --depth == 0) return p + 1;
+            p++;
+        }
+        return NULL;
+    }
+    // number, true, false, null
+    while (p < end && !strchr(",}] \t\r\n", *p)) p++;
+    return p;
+}
+static struct json_token token_for(const char *start, const char *end) {
+    struct json_token t = { start, end - start, JSON_TYPE_NUMBER };
+    switch (*start) {
+    case '"': t.ptr++; t.len -= 2; t.type = JSON_TYPE_STRING; break;
+    case '[': t.type = JSON_TYPE_ARRAY_END; break;
+    case '{': t.type = JSON_TYPE_OBJECT_END; break;
+    case 't': t.type = JSON_TYPE_TRUE; break;
+    case 'f': t.type = JSON_TYPE_FALSE; break;
+    case 'n': t.type = JSON_TYPE_NULL; break;
+    }
+    return t;
+}
+static long long token_to_ll(const struct json_token *t) {
+    const char *p = t->ptr, *end = t->ptr + t->len;
+    int neg = (p < end && *p == '-');
+    if (neg) p++;
+    unsigned long long v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) v = v*10 + (*p - '0');
+    return neg ? -(long long)v : (long long)v;
+}
+static int token_is(const char *s, size_t len, const char *lit) {
+    return len == strlen(lit) && memcmp(s, lit, len) == 0;
+}
+
+static int response_parse(struct response *resp, char *data, size_t size) {
+    const char *p = data, *end = data + size;
+    resp->data = data;
+    resp->size = size;
+    resp->has_id = resp->has_error = 0;
+    resp->num_fields = 0;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '{') return -1;
+    p = skip_ws(p + 1, end);
+    if (p < end && *p == '}') return 0;
+    for (;;) {
+        if (p >= end || *p != '"') return -1;
+        const char *key = p + 1;
+        p = skip_string(p, end);
+        if (p == NULL) return -1;
+        size_t key_len = p - 1 - key;
+
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':') return -1;
+        p = skip_ws(p + 1, end);
+
+        const char *value = p;
+        p = skip_value(p, end);
+        if (p == NULL || p == value) return -1;
+        struct json_token t = token_for(value, p);
+
+        if (token_is(key, key_len, "id")) {
+            resp->has_id = 1;
+            resp->id = (uint64_t)token_to_ll(&t);
+        } else if (token_is(key, key_len, "error")) {
+            resp->has_error = 1;
+            resp->error = (int)token_to_ll(&t);
+        } else if (resp->num_fields < MAX_RESPONSE_FIELDS) {
+            resp->fields[resp->num_fields++] =
+                (struct response_field) { key, key_len, t };
+        }
+
+        p = skip_ws(p, end);
+        if (p < end && *p == ',') { p = skip_ws(p + 1, end); continue; }
+        if (p < end && *p == '}') return 0;
+        return -1;
+    }
+}
+
+static const struct json_token *response_get(const struct response *resp,
+                                             const char *key, size_t key_len) {
+    for (int i = 0; i < resp->num_fields; i++) {
+        const struct response_field *f = &resp->fields[i];
+        if (f->key_len == key_len && memcmp(f->key, key, key_len) == 0) {
+            return &f->value;
+        }
+    }
+    return NULL;
+}
+
+// Steps through the elements of an array token, one per call. *posp
+// should start out NULL. Returns 0 after the last element.
+static int token_array_next(const struct json_token *arr, const char **posp,
+                            struct json_token *elem) {
+    const char *end = arr->ptr + arr->len - 1; // the closing ]
+    const char *p = *posp ? *posp : arr->ptr + 1;
+    p = skip_ws(p, end);
+    if (p < end && *p == ',') p = skip_ws(p + 1, end);
+    if (p >= end) return 0;
+
+    const char *value = p;
+    p = skip_value(p, end);
+    if (p == NULL || p == value) return 0;
+    *elem = token_for(value, p);
+    *posp = p;
+    return 1;
+}
+
+// Like json_scanf, but against an already-parsed response, and only
+// for flat "key: %d, key2: %T" formats. Supports %d, %u, %lld, %llu,
+// %B (true/false, into an int) and %T. Returns the number of keys
+// found.
+static int response_scanf(const struct response *resp, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int found = 0;
+    const char *p = fmt;
+    for (;;) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '\0') break;
+
+        const char *key = p;
+        while (*p != ':' && *p != '\0') p++;
+        size_t key_len = p - key;
+        while (*p == ':' || *p == ' ') p++;
+        const char *conv = p;
+        while (*p != ',' && *p != '\0') p++;
+
+        void *target = va_arg(ap, void *);
+        const struct json_token *t = response_get(resp, key, key_len);
+        if (t == NULL) continue;
+
+        if (conv[1] == 'T') {
+            *(struct json_token *)target = *t;
+        } else if (conv[1] == 'B') {
+            if (t->type != JSON_TYPE_TRUE && t->type != JSON_TYPE_FALSE) continue;
+            *(int *)target = t->type == JSON_TYPE_TRUE;
+        } else if (t->type != JSON_TYPE_NUMBER) {
+            continue;
+        } else if (conv[1] == 'l' && conv[2] == 'l') {
+            *(long long *)target = token_to_ll(t);
+        } else {
+            *(int *)target = (int)token_to_ll(t);
+        }
+        found++;
+    }
+    va_end(ap);
+    return found;
+}
+
+// base64. read() payloads can be megabytes (visible-tab.png, big
+// scripts and resources under debugger/), so decoding them is on the
+// hot path: use AVX2 or SSSE3 when the CPU has it, and a table lookup
+// otherwise.
+static const int8_t base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// Each of these decodes whole groups of 4 characters from *srcp into
+// *dstp, advancing both, and stops early (leaving the rest for the
+// caller) at padding, at anything that isn't base64, or when dst is
+// about to run out.
+static void base64_decode_scalar(const char **srcp, const char *src_end,
+                                 char **dstp, char *dst_end) {
+    const unsigned char *s = (const unsigned char *)*srcp;
+    unsigned char *d = (unsigned char *)*dstp;
+    while ((const char *)s + 4 <= src_end && (char *)d + 3 <= dst_end) {
+        int a = base64_values[s[0]], b = base64_values[s[1]],
+            c = base64_values[s[2]], e = base64_values[s[3]];
+        if ((a | b | c | e) < 0) break;
+        uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | (uint32_t)e;
+        d[0] = v >> 16; d[1] = v >> 8; d[2] = v;
+        s += 4; d += 3;
+    }
+    *srcp = (const char *)s;
+    *dstp = (char *)d;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// The vector decoders follow Wojciech Muła's approach (as in
+// https://github.com/aklomp/base64): classify each char by its high
+// and low nibble with two table lookups to find invalid chars, add a
+// per-range offset to get each 6-bit value, then pack 4 x 6 bits
+// into 3 bytes with multiply-adds and a shuffle.
+
+__attribute__((target("avx2")))
+static void base64_decode_avx2(const char **srcp, const char *src_end,
+                               char **dstp, char *dst_end) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack_shuffle = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i pack_permute = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    const char *s = *srcp;
+    char *d = *dstp;
+    // 32 chars in -> 24 bytes out, but the store writes all 32
+    while (s + 32 <= src_end && d + 32 <= dst_end) {
+        __m256i str = _mm256_loadu_si256((const __m256i *)s);
+
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;
+
+        __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+        str = _mm256_shuffle_epi8(str, pack_shuffle);
+        str = _mm256_permutevar8x32_epi32(str, pack_permute);
+        _mm256_storeu_si256((__m256i *)d, str);
+
+        s += 32; d += 24;
+    }
+    *srcp = s;
+    *dstp = d;
+}
+
+__attribute__((target("ssse3")))
+static void base64_decode_ssse3(const char **srcp, const char *src_end,
+                                char **dstp, char *dst_end) {
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack_shuffle = _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    const char *s = *srcp;
+    char *d = *dstp;
+    // 16 chars in -> 12 bytes out, but the store writes all 16
+    while (s + 16 <= src_end && d + 16 <= dst_end) {
+        __m128i str = _mm_loadu_si128((const __m128i *)s);
+
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        if (_mm_movemask_epi8(invalid) != 0xFFFF) break;
+
+        __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, pack_shuffle);
+        _mm_storeu_si128((__m128i *)d, str);
+
+        s += 16; d += 12;
+    }
+    *srcp = s;
+    *dstp = d;
+}
+#endif
+
+typedef void base64_decoder(const char **srcp, const char *src_end,
+                            char **dstp, char *dst_end);
+static base64_decoder *base64_pick_decoder(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) return base64_decode_avx2;
+    if (__builtin_cpu_supports("ssse3")) return base64_decode_ssse3;
+#endif
+    return base64_decode_scalar;
+}
+static base64_decoder *base64_decode_fast;
+
+// Decodes base64 straight into a caller-provided buffer (like the one
+// FUSE gives us in read). Stops once dst is full. Returns the number
+// of bytes written.
+static size_t base64_decode_into(char *dst, size_t cap,
+                                 const char *src, size_t len) {
+    const char *s = src, *s_end = src + len;
+    char *d = dst, *d_end = dst + cap;
+
+    if (base64_decode_fast == NULL) base64_decode_fast = base64_pick_decoder();
+    base64_decode_fast(&s, s_end, &d, d_end);
+    base64_decode_scalar(&s, s_end, &d, d_end);
+
+    // what's left is at most one group that's padded, or that doesn't
+    // completely fit in dst
+    if (s + 2 <= s_end && d < d_end) {
+        const unsigned char *u = (const unsigned char *)s;
+        int a = base64_values[u[0]], b = base64_values[u[1]];
+        int c = s + 2 < s_end ? base64_values[u[2]] : -1;
+        int e = s + 3 < s_end ? base64_values[u[3]] : -1;
+        if (a >= 0 && b >= 0) {
+            char tmp[3] = {
+                (char)(a << 2 | b >> 4),
+                (char)(b << 4 | (c >= 0 ? c : 0) >> 2),
+                (char)((c >= 0 ? c : 0) << 6 | (e >= 0 ? e : 0)),
+            };
+            size_t m = c < 0 ? 1 : e < 0 ? 2 : 3;
+            if (m > (size_t)(d_end - d)) m = d_end - d;
+            memcpy(d, tmp, m);
+            d += m;
+        }
+    }
+    return d - dst;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t hash_path(const char *path) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (; *path; path++) h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+    return h;
+}
+static uint64_t hash_bytes(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Attribute cache, so that the pile of getattrs that shells, editors,
+// `find`, and `ls -l` do on the same paths doesn't turn into a pile of
+// round trips to the browser. Filled in by getattr and by readdirs
+// that come back with attrs.
+//
+// Entries expire after attr_cache_ttl_ns (TABFS_ATTR_TIMEOUT, in
+// seconds). The extension also tells us when a tab or window changes
+// (see handle_notification), and we throw out everything under it
+// right away, so you shouldn't see an old URL or title even with a
+// long timeout.
+//
+// It also remembers paths the browser told us don't exist (for
+// TABFS_NEGATIVE_TIMEOUT seconds), since a lot of lookups are
+// autocomplete and prompt scripts poking at things that aren't there.
+// Those get evicted the same way, plus whenever a readdir lists them.
+//
+// Each bucket holds a handful of entries; when one fills up, we
+// overwrite whichever entry expires soonest.
+#define ATTR_CACHE_BUCKETS 1024
+#define ATTR_CACHE_WAYS 8
+
+// same as FUSE's default attr_timeout by default
+static uint64_t attr_cache_ttl_ns = 1000*1000*1000ULL;
+static uint64_t negative_cache_ttl_ns = 1000*1000*1000ULL;
+
+// bumped on every eviction. a getattr that was already in flight when
+// something got evicted may have gotten the old attributes back, so
+// it shouldn't put them in the cache.
+static uint64_t attr_cache_gen;
+
+static struct attr_bucket {
+    pthread_mutex_t lock;
+    struct attr_entry {
+        uint64_t hash;
+        char *path; // NULL if the slot is empty
+        uint64_t expires;
+        int error; // if nonzero, getattr on path fails with -error
+        mode_t mode;
+        nlink_t nlink;
+        off_t size;
+    } entries[ATTR_CACHE_WAYS];
+} attr_cache[ATTR_CACHE_BUCKETS] = {
+    [0 ... ATTR_CACHE_BUCKETS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static struct attr_entry *attr_cache_find(struct attr_bucket *b,
+                                          uint64_t hash, const char *path) {
+    for (int i = 0; i < ATTR_CACHE_WAYS; i++) {
+        struct attr_entry *e = &b->entries[i];
+        if (e->path && e->hash == hash && strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+static void attr_entry_clear(struct attr_entry *e) {
+    free(e->path);
+    e->path = NULL;
+    e->expires = 0;
+}
+
+static uint64_t attr_cache_generation(void) {
+    return __atomic_load_n(&attr_cache_gen, __ATOMIC_ACQUIRE);
+}
+
+// Returns 1 and fills in st if we know path's attributes, -errno if
+// we know it doesn't exist, or 0 if we don't know anything.
+static int attr_cache_get(const char *path, struct stat *st) {
+    if (attr_cache_ttl_ns == 0 && negative_cache_ttl_ns == 0) return 0;
+    uint64_t hash = hash_path(path);
+    struct attr_bucket *b = &attr_cache[hash % ATTR_CACHE_BUCKETS];
+    int rv = 0;
+
+    pthread_mutex_lock(&b->lock);
+    struct attr_entry *e = attr_cache_find(b, hash, path);
+    if (e && e->expires > now_ns()) {
+        if (e->error) {
+            rv = -e->error;
+        } else {
+            memset(st, 0, sizeof(*st));
+            st->st_mode = e->mode;
+            st->st_nlink = e->nlink;
+            st->st_size = e->size;
+            rv = 1;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return rv;
+}
+
+static void attr_cache_store(const char *path, const struct stat *st,
+                             int error, uint64_t ttl, uint64_t gen) {
+    if (ttl == 0) return;
+    uint64_t hash = hash_path(path);
+    struct attr_bucket *b = &attr_cache[hash % ATTR_CACHE_BUCKETS];
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&b->lock);
+    // checked under the bucket lock, so an eviction either happens
+    // after we're done here or bumps gen before we look at it.
+    if (gen == attr_cache_generation()) {
+        struct attr_entry *e = attr_cache_find(b, hash, path);
+        if (e == NULL) {
+            e = &b->entries[0];
+            for (int i = 0; i < ATTR_CACHE_WAYS; i++) {
+                if (b->entries[i].expires < e->expires) e = &b->entries[i];
+            }
+            free(e->path);
+            e->hash = hash;
+            e->path = strdup(path);
+        }
+        e->expires = now + ttl;
+        e->error = error;
+        if (st) {
+            e->mode = st->st_mode;
+            e->nlink = st->st_nlink;
+            e->size = st->st_size;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+// gen is what attr_cache_generation() returned before we asked the
+// browser for these attributes.
+static void attr_cache_put(const char *path, const struct stat *st, uint64_t gen) {
+    attr_cache_store(path, st, 0, attr_cache_ttl_ns, gen);
+}
+static void attr_cache_put_error(const char *path, int error, uint64_t gen) {
+    attr_cache_store(path, NULL, error, negative_cache_ttl_ns, gen);
+}
+
+// Drops path if we think it doesn't exist (because a readdir just
+// listed it, for instance), but keeps its attributes if we have them.
+static void attr_cache_forget_error(const char *path) {
+    uint64_t hash = hash_path(path);
+    struct attr_bucket *b = &attr_cache[hash % ATTR_CACHE_BUCKETS];
+
+    pthread_mutex_lock(&b->lock);
+    struct attr_entry *e = attr_cache_find(b, hash, path);
+    if (e && e->error) {
+        __atomic_fetch_add(&attr_cache_gen, 1, __ATOMIC_RELEASE);
+        attr_entry_clear(e);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void attr_cache_evict(const char *path) {
+    uint64_t hash = hash_path(path);
+    struct attr_bucket *b = &attr_cache[hash % ATTR_CACHE_BUCKETS];
+
+    pthread_mutex_lock(&b->lock);
+    __atomic_fetch_add(&attr_cache_gen, 1, __ATOMIC_RELEASE);
+    struct attr_entry *e = attr_cache_find(b, hash, path);
+    if (e) attr_entry_clear(e);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Evicts path and everything under it. Walks the whole cache, but it's
+// only ~8K entries and this only happens when the browser tells us
+// something changed.
+static void attr_cache_evict_tree(const char *path) {
+    size_t len = strlen(path);
+    if (len > 0 && path[len-1] == '/') len--; // so "/" is everything
+
+    for (int i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+        struct attr_bucket *b = &attr_cache[i];
+        pthread_mutex_lock(&b->lock);
+        __atomic_fetch_add(&attr_cache_gen, 1, __ATOMIC_RELEASE);
+        for (int j = 0; j < ATTR_CACHE_WAYS; j++) {
+            struct attr_entry *e = &b->entries[j];
+            if (e->path && strncmp(e->path, path, len) == 0 &&
+                (e->path[len] == '\0' || e->path[len] == '/')) {
+                attr_entry_clear(e);
+            }
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+// Counters for /.tabfs/stats, per kind of request we send the
+// extension. Everything is a relaxed atomic, so a snapshot can be a
+// little inconsistent across fields, which is fine for this.
+enum {
+    OP_GETATTR, OP_READLINK, OP_OPEN, OP_READ, OP_WRITE, OP_FLUSH, OP_FSYNC,
+    OP_RELEASE, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_TRUNCATE,
+    OP_UNLINK, OP_MKDIR, OP_MKNOD, OP_POLL, OP_OTHER, NUM_OPS
+};
+static const char *op_names[NUM_OPS] = {
+    "getattr", "readlink", "open", "read", "write", "flush", "fsync",
+    "release", "opendir", "readdir", "releasedir", "truncate",
+    "unlink", "mkdir", "mknod", "poll", "other"
 };
 
-static struct resumedata **waiters;
-static size_t numwaiters;
+// bucket i counts round trips that took [2^i, 2^(i+1)) us (the first
+// one also gets everything under 1us, the last everything over)
+#define LATENCY_BUCKETS 24
+
+static struct op_stats {
+    uint64_t requests, errors, timeouts, interrupts, in_flight;
+    // requests that didn't go to the browser at all, because an
+    // identical one was already on its way (see do_exchange_shared)
+    uint64_t coalesced;
+    uint64_t total_ns;
+    // how long the extension says its handler took; the rest of
+    // total_ns is us, the pipe, and the browser's message passing
+    uint64_t browser_ns, browser_reports;
+    uint64_t bytes_out, bytes_in, messages_in, max_message_in;
+    uint64_t latency[LATENCY_BUCKETS];
+} op_stats[NUM_OPS];
+
+// things we answered without asking the extension
+static struct {
+    uint64_t attr_hits, attr_negative_hits, attr_misses, denied;
+    uint64_t notifications;
+    // daemon mode
+    uint64_t connects, replays;
+    // opens the kernel could cache, and how many of those it got to
+    // keep what it had from before (see tabfs_open)
+    uint64_t cacheable_opens, kept_opens;
+} local_stats;
+
+static uint64_t stats_start_ns;
+
+#define stats_add(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define stats_get(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static int op_index(const char *op) {
+    for (int i = 0; i < OP_OTHER; i++) {
+        if (strcmp(op, op_names[i]) == 0) return i;
+    }
+    return OP_OTHER;
+}
 
-static void read_or_die(int fd, void *buf, size_t sz) {
+static int latency_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int i = 0;
+    while (us > 1 && i < LATENCY_BUCKETS - 1) { us >>= 1; i++; }
+    return i;
+}
+
+static void stats_message_in(int op, size_t size) {
+    struct op_stats *s = &op_stats[op];
+    stats_add(s->bytes_in, size);
+    stats_add(s->messages_in, 1);
+    uint64_t max = stats_get(s->max_message_in);
+    while (size > max &&
+           !__atomic_compare_exchange_n(&s->max_message_in, &max, size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Protects writing to a browser. Threads waiting for it line up by
+// priority instead of however the mutex feels like waking them:
+// metadata requests (getattr, readdir, ...) and cancels go ahead of
+// everything else, so a stat doesn't sit behind a pile of 128K writes.
+// (Each message still goes out whole; only which one goes next
+// changes.)
+enum { PRIO_HIGH, PRIO_LOW, NUM_PRIOS };
+struct write_waiter {
+    int turn;
+    pthread_cond_t cond;
+    struct write_waiter *next;
+};
+struct write_lock {
+    pthread_mutex_t lock;
+    int held;
+    struct write_waiter *queue[NUM_PRIOS];
+};
+#define WRITE_LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, { NULL, NULL } }
+
+static void write_lock_acquire(struct write_lock *wl, int prio) {
+    pthread_mutex_lock(&wl->lock);
+    if (!wl->held) {
+        wl->held = 1;
+    } else {
+        struct write_waiter w = { 0, PTHREAD_COND_INITIALIZER, NULL };
+        struct write_waiter **pp = &wl->queue[prio];
+        while (*pp) pp = &(*pp)->next;
+        *pp = &w;
+        while (!w.turn) pthread_cond_wait(&w.cond, &wl->lock);
+        pthread_cond_destroy(&w.cond);
+    }
+    pthread_mutex_unlock(&wl->lock);
+}
+static void write_lock_release(struct write_lock *wl) {
+    pthread_mutex_lock(&wl->lock);
+    struct write_waiter *next = NULL;
+    for (int prio = 0; prio < NUM_PRIOS && next == NULL; prio++) {
+        next = wl->queue[prio];
+        if (next) wl->queue[prio] = next->next;
+    }
+    if (next) {
+        // straight to the next in line (so it stays held)
+        next->turn = 1;
+        pthread_cond_signal(&next->cond);
+    } else {
+        wl->held = 0;
+    }
+    pthread_mutex_unlock(&wl->lock);
+}
+
+static int op_priority(int op) {
+    switch (op) {
+    case OP_GETATTR: case OP_READLINK:
+    case OP_OPENDIR: case OP_READDIR: case OP_RELEASEDIR:
+    case OP_POLL:
+        return PRIO_HIGH;
+    default:
+        return PRIO_LOW;
+    }
+}
+
+// Where the reader thread should decode the `buf` of a read response.
+//
+// The extension splits a response with a big `buf` into several
+// messages: {id, buf: <part>, more: true} for each part but the last,
+// then the rest of the response as usual. Each part is the base64 of a
+// multiple of 3 bytes, so it decodes on its own, and the reader thread
+// decodes each one straight into dst as it comes in.
+struct read_stream {
+    char *dst;
+    size_t cap;
+    size_t len;
+};
+
+struct browser;
+
+// An in-flight request. It usually lives on the stack of the thread
+// that sent it until the reader thread hands it a response and wakes
+// it up.
+struct request {
+    struct browser *browser;
+    uint64_t id;
+    int done;
+    pthread_cond_t cond;
+    struct response resp;
+    // buffer that the reader thread can have in exchange for resp.data
+    char *spare;
+    // NULL unless this is a read that can take a multi-part response
+    struct read_stream *stream;
+    int bad_parts; // got a multi-part response anyway
+    // the reader thread is decoding a part into stream, so the waiter
+    // can't give up on it and return just yet
+    int busy;
+    // for op_stats
+    int op;
+    uint64_t start_ns;
+    // which connection to the extension it went out on (0 if it
+    // hasn't yet), and whether that connection went away before it
+    // got an answer
+    uint64_t conn_gen;
+    int lost;
+    struct request *next;
+};
+
+// Pending requests, hashed by id. Each bucket has its own lock, so
+// FUSE threads sending and receiving unrelated requests don't all
+// serialize on one mutex.
+#define PENDING_BUCKETS 64
+struct pending_bucket {
+    pthread_mutex_t lock;
+    struct request *head;
+};
+
+// A browser (an extension, really) that we're talking to. Usually
+// there's just the one, over our own stdin and stdout, since it's the
+// one that started us. In daemon mode (see main) every connection to
+// our socket is a browser, under whatever name its relay gives us. A
+// slot outlives its connection: when a browser with the same name
+// connects again (after the extension reloads, say), it picks up
+// where the old one left off.
+//
+// Each one has its own table of requests waiting on it and its own
+// lock on writing to it, so a slow browser doesn't hold up the rest.
+#define MAX_BROWSERS 16
+#define MAX_BROWSER_NAME 64
+static struct browser {
+    char name[MAX_BROWSER_NAME];
+    int used; // slots get used, and then reused by name, never freed
+    int connected; // (both under browsers_lock)
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // -1 while it's not connected. out only changes with the write
+    // lock held, so a writer can't have it closed out from under it.
+    int in, out;
+    // bumped on every disconnect, so we can tell which requests went
+    // out to an extension that's gone now
+    uint64_t gen;
+
+    struct write_lock write_lock;
+    struct pending_bucket pending[PENDING_BUCKETS];
+} browsers[MAX_BROWSERS] = {
+#define BROWSER_INITIALIZER(name, used, in, out) \
+    { name, used, (in) >= 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, in, out, 1, \
+      WRITE_LOCK_INITIALIZER, \
+      { [0 ... PENDING_BUCKETS-1] = { PTHREAD_MUTEX_INITIALIZER, NULL } } }
+    // the one that started us, unless we're a daemon
+    [0] = BROWSER_INITIALIZER("browser", 1, STDIN_FILENO, STDOUT_FILENO),
+    [1 ... MAX_BROWSERS-1] = BROWSER_INITIALIZER("", 0, -1, -1),
+};
+// for waiting on any browser at all to show up, and for handing out
+// slots
+static pthread_mutex_t browsers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t browsers_changed = PTHREAD_COND_INITIALIZER;
+// how many are connected right now, and which, if it's just one (see
+// browser_for); browsers_recount keeps them up to date
+static int num_connected = 1;
+static struct browser *sole_browser = &browsers[0];
+
+// (with browsers_lock held)
+static void browsers_recount(void) {
+    int n = 0;
+    struct browser *sole = NULL;
+    for (int i = 0; i < MAX_BROWSERS; i++) {
+        if (browsers[i].connected) { n++; sole = &browsers[i]; }
+    }
+    __atomic_store_n(&sole_browser, n == 1 ? sole : NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&num_connected, n, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&browsers_changed);
+}
+
+// Ids are never reused, so a late reply can't be mistaken for the
+// reply to some newer request. (Starts at 1 so 0 is never an id.)
+// They're unique across browsers, too.
+static uint64_t next_request_id = 1;
+
+static struct pending_bucket *bucket_for(struct browser *br, uint64_t id) {
+    return &br->pending[id % PENDING_BUCKETS];
+}
+
+// Takes req out of its bucket's table (with the bucket locked).
+// Returns 0 if it wasn't there, because the reader thread already
+// took it to hand it a response.
+static int request_unlink(struct pending_bucket *b, struct request *req) {
+    for (struct request **pp = &b->head; *pp; pp = &(*pp)->next) {
+        if (*pp == req) {
+            *pp = req->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// How long we wait for any reply before giving up on it. The extension
+// gives up on its own after each route's deadline (`timeout` in
+// background.js) and answers ETIMEDOUT, so this is a backstop, for
+// when it isn't answering anything at all: then at least it doesn't
+// keep FUSE threads forever. TABFS_TIMEOUT, in seconds.
+static uint64_t request_timeout_ns = 30*1000*1000*1000ULL;
+
+// Set once we're mounted, so waits can check fuse_interrupted() (which
+// only works on FUSE's threads). The kernel tells FUSE about an
+// interrupt (like Ctrl-C on a slow cat) and FUSE flags the request,
+// but nothing wakes us up, so we look every so often.
+static int fuse_running;
+#define INTERRUPT_POLL_NS (50*1000*1000ULL)
+
+// Return -1 on EOF or an error (besides the ones worth retrying).
+static int read_all(int fd, void *buf, size_t sz) {
     size_t sofar = 0;
     while (sofar < sz) {
         ssize_t rv = read(fd, (char *)buf+sofar, sz-sofar);
         if (rv == -1) {
             if (errno == EINTR || errno == EAGAIN) continue;
             perror("read error");
-            exit(1);
+            return -1;
         }
-        if (rv == 0) exit(1);
+        if (rv == 0) return -1;
         sofar += (size_t)rv;
     }
+    return 0;
 }
-static void write_or_die(int fd, void *buf, size_t sz) {
-    size_t sofar = 0;
-    while (sofar < sz) {
-        ssize_t rv = write(fd, (char *)buf+sofar, sz-sofar);
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t rv = writev(fd, iov, iovcnt);
         if (rv == -1) {
             if (errno == EINTR || errno == EAGAIN) continue;
             perror("write error");
-            exit(1);
+            return -1;
+        }
+        if (rv == 0) return -1;
+        // partial write: skip past whatever got written
+        while (iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++; iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
         }
-        if (rv == 0) exit(1);
-        sofar += (size_t)rv;
     }
+    return 0;
+}
+static void cond_wait_ns(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t ns) {
+    // (timedwait wants a wall clock time)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t nsec = ts.tv_nsec + ns % 1000000000;
+    ts.tv_sec += ns / 1000000000 + nsec / 1000000000;
+    ts.tv_nsec = nsec % 1000000000;
+    pthread_cond_timedwait(cond, lock, &ts);
 }
 
-// documented somewhere in https://developer.chrome.com/docs/apps/nativeMessaging/
-#define MAX_MESSAGE_SIZE (size_t)(1024*1024)
+static int daemon_mode;
+
+// In daemon mode, how long a request waits for its browser to
+// (re)connect before it fails with ENOTCONN. TABFS_RECONNECT_WAIT,
+// in seconds.
+static uint64_t reconnect_wait_ns = 5*1000*1000*1000ULL;
+
+// A request whose extension went away before answering gets sent again
+// (to the next one) up to this many times. Most of what we send is
+// safe to repeat; the rest (say, a write to /tabs/create) at worst
+// happens twice if the extension did it right before it went.
+#define MAX_REPLAYS 2
+
+// Waits (with lock locked) until ready(ud), for up to
+// reconnect_wait_ns.
+static int wait_for_connect(pthread_mutex_t *lock, pthread_cond_t *cond,
+                            int (*ready)(void *ud), void *ud) {
+    int rv = 0;
+    uint64_t deadline = now_ns() + reconnect_wait_ns;
+    while (!ready(ud)) {
+        uint64_t now = now_ns();
+        if (now >= deadline) { rv = -ENOTCONN; break; }
+        if (fuse_running && fuse_interrupted()) { rv = -EINTR; break; }
+
+        uint64_t wait = deadline - now;
+        if (fuse_running && wait > INTERRUPT_POLL_NS) wait = INTERRUPT_POLL_NS;
+        cond_wait_ns(cond, lock, wait);
+    }
+    return rv;
+}
+static int browser_connected(void *ud) { return ((struct browser *)ud)->out >= 0; }
+static int any_connected(void *ud) { (void)ud; return num_connected > 0; }
+
+static int extension_wait(struct browser *br) {
+    if (!daemon_mode) return 0;
+    pthread_mutex_lock(&br->lock);
+    int rv = wait_for_connect(&br->lock, &br->changed, browser_connected, br);
+    pthread_mutex_unlock(&br->lock);
+    return rv;
+}
 
-static int do_exchange(unsigned int id,
-                       char **datap, size_t *sizep,
-                       const char *fmt, ...) {
-    *datap = NULL;
-    *sizep = 0;
+// Writes a message to br (with its write lock held). Returns -1 if
+// it's not connected, or it went away.
+static int extension_writev(struct browser *br, struct iovec *iov, int iovcnt) {
+    if (br->out < 0) return -1;
+    if (writev_all(br->out, iov, iovcnt) == 0) return 0;
+    if (!daemon_mode) exit(1);
+    // (so the reader notices, if it hasn't yet)
+    shutdown(br->out, SHUT_RDWR);
+    return -1;
+}
 
-    char *jsonbuf = malloc(MAX_MESSAGE_SIZE);
-    struct json_out out = JSON_OUT_BUF(jsonbuf, MAX_MESSAGE_SIZE);
+static size_t print_request(char *buf, size_t cap, uint64_t id,
+                            const char *fmt, va_list args) {
+    struct json_out out = JSON_OUT_BUF(buf, cap);
+    va_list args_copy;
+    va_copy(args_copy, args);
+    size_t size = (size_t)json_printf(&out, "{id: %llu, ", id);
+    size += (size_t)json_vprintf(&out, fmt, args_copy);
+    size += (size_t)json_printf(&out, "}");
+    va_end(args_copy);
+    return size;
+}
 
-    va_list args;
-    va_start(args, fmt);
-     size_t request_size = (size_t)json_vprintf(&out, fmt, args);
-    va_end(args);
+// every request starts with `op: %Q`
+static int op_of(const char *fmt, va_list args) {
+    int op = OP_OTHER;
+    if (strncmp(fmt, "op: %Q", 6) == 0) {
+        va_list peek;
+        va_copy(peek, args);
+        op = op_index(va_arg(peek, const char *));
+        va_end(peek);
+    }
+    return op;
+}
+
+// Sends a request without waiting for the reply, so a thread can have
+// several requests in flight at once. `fmt` is the body of the JSON
+// object minus the braces; the id is filled in here. Every successful
+// exchange_vsend must be followed by an exchange_recv on the same req.
+static int exchange_vsend(struct browser *br, struct request *req,
+                          const char *fmt, va_list args) {
+    struct thread_bufs *tb = thread_bufs();
+
+    int rv = extension_wait(br);
+    if (rv != 0) return rv;
+
+    req->browser = br;
+    req->id = __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED);
+    req->done = 0;
+    req->bad_parts = 0;
+    req->busy = 0;
+    req->conn_gen = 0;
+    req->lost = 0;
+
+    req->op = op_of(fmt, args);
+
+    // most requests are tiny, so try with whatever buffer we already
+    // have and only grow it if the request didn't fit.
+    msgbuf_reserve(&tb->request, 4096);
+    size_t request_size = print_request(tb->request, msgbuf_cap(tb->request),
+                                        req->id, fmt, args);
     if (request_size > MAX_MESSAGE_SIZE) {
         eprintln("warning: request too big to send (%zu > %zu)",
             request_size, MAX_MESSAGE_SIZE);
-        free(jsonbuf);
         return -EMSGSIZE;
     }
+    if (request_size > msgbuf_cap(tb->request)) {
+        msgbuf_reserve(&tb->request, request_size);
+        print_request(tb->request, msgbuf_cap(tb->request),
+                      req->id, fmt, args);
+    }
+
+    req->spare = tb->spare_response;
+    tb->spare_response = NULL;
+
+    // register before writing, so the reply can't beat us to the table
+    pthread_cond_init(&req->cond, NULL);
+    struct pending_bucket *b = bucket_for(br, req->id);
+    pthread_mutex_lock(&b->lock);
+    req->next = b->head;
+    b->head = req;
+    pthread_mutex_unlock(&b->lock);
+
+    uint32_t size_4bytes = request_size;
+    struct iovec iov[2] = {
+        { &size_4bytes, sizeof(size_4bytes) },
+        { tb->request, request_size },
+    };
+
+    struct op_stats *s = &op_stats[req->op];
+    stats_add(s->requests, 1);
+    stats_add(s->in_flight, 1);
+    stats_add(s->bytes_out, request_size);
+    req->start_ns = now_ns();
+
+    write_lock_acquire(&br->write_lock, op_priority(req->op));
+    if (br->out >= 0) {
+        req->conn_gen = br->gen;
+        extension_writev(br, iov, 2);
+    } else {
+        // it went away again since extension_wait; this one's lost
+        // before it even went out
+        pthread_mutex_lock(&b->lock);
+        if (request_unlink(b, req)) {
+            req->lost = 1;
+            req->done = 1;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    write_lock_release(&br->write_lock);
+
+    return 0;
+}
+
+// Tells the extension we're not waiting for request `id` anymore, so it
+// can stop working on it and not bother answering.
+static void exchange_cancel(struct browser *br, uint64_t id) {
+    char buf[64];
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    uint32_t size_4bytes = json_printf(&out, "{op: %Q, id: %llu}",
+                                       "cancel", (unsigned long long)id);
+    struct iovec iov[2] = {
+        { &size_4bytes, sizeof(size_4bytes) },
+        { buf, size_4bytes },
+    };
+    write_lock_acquire(&br->write_lock, PRIO_HIGH);
+    extension_writev(br, iov, 2);
+    write_lock_release(&br->write_lock);
+}
+
+// Waits (with the bucket locked) until req is done, its deadline
+// passes, or the FUSE request behind it gets interrupted.
+static int request_wait(struct pending_bucket *b, struct request *req) {
+    uint64_t deadline = req->start_ns + request_timeout_ns;
+    while (!req->done) {
+        uint64_t now = now_ns();
+        if (now >= deadline) return -ETIMEDOUT;
+        if (fuse_running && fuse_interrupted()) return -EINTR;
+
+        uint64_t wait = deadline - now;
+        if (fuse_running && wait > INTERRUPT_POLL_NS) wait = INTERRUPT_POLL_NS;
+        cond_wait_ns(&req->cond, &b->lock, wait);
+    }
+    return 0;
+}
+
+static int exchange_recv(struct request *req, struct response *resp) {
+    struct pending_bucket *b = bucket_for(req->browser, req->id);
+    pthread_mutex_lock(&b->lock);
+    int rv = request_wait(b, req);
+    if (rv != 0) {
+        if (request_unlink(b, req)) {
+            // gone for good, as far as the reader is concerned; just
+            // make sure it's not still writing into our buffer
+            while (req->busy) pthread_cond_wait(&req->cond, &b->lock);
+        } else {
+            // too late: the reader has the reply and is about to
+            // hand it over
+            while (!req->done) pthread_cond_wait(&req->cond, &b->lock);
+            rv = 0;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    pthread_cond_destroy(&req->cond);
+
+    // if the reader didn't need our spare buffer, hang onto it
+    if (req->spare) msgbuf_release(req->spare);
+
+    uint64_t elapsed = now_ns() - req->start_ns;
+    struct op_stats *s = &op_stats[req->op];
+    __atomic_fetch_sub(&s->in_flight, 1, __ATOMIC_RELAXED);
+    stats_add(s->total_ns, elapsed);
+    stats_add(s->latency[latency_bucket(elapsed)], 1);
+
+    if (rv == 0 && req->lost) {
+        // the caller should send it again
+        stats_add(local_stats.replays, 1);
+        return -ECONNRESET;
+    }
+    if (rv != 0) {
+        exchange_cancel(req->browser, req->id);
+        stats_add(s->errors, 1);
+        if (rv == -ETIMEDOUT) stats_add(s->timeouts, 1);
+        else stats_add(s->interrupts, 1);
+        return rv;
+    }
+
+    *resp = req->resp;
+    unsigned long long browser_us;
+    if (response_scanf(resp, "browser_us: %llu", &browser_us) == 1) {
+        stats_add(s->browser_ns, browser_us * 1000);
+        stats_add(s->browser_reports, 1);
+    }
+    if (resp->has_error) {
+        stats_add(s->errors, 1);
+        if (resp->error == ETIMEDOUT) stats_add(s->timeouts, 1);
+        response_free(resp);
+        return -resp->error;
+    }
+    return 0;
+}
+
+static int exchange_send(struct browser *br, struct request *req, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int rv = exchange_vsend(br, req, fmt, args);
+    va_end(args);
+    return rv;
+}
+
+// exchange_recv's -ECONNRESET means to send it again, but FUSE
+// shouldn't ever see it.
+static int replay_giving_up(int rv) {
+    return rv == -ECONNRESET ? -EIO : rv;
+}
+
+static int do_exchange(struct browser *br, struct response *resp, const char *fmt, ...) {
+    int rv;
+    for (int tries = 0; tries <= MAX_REPLAYS; tries++) {
+        struct request req = { .stream = NULL };
+
+        va_list args;
+        va_start(args, fmt);
+        rv = exchange_vsend(br, &req, fmt, args);
+        va_end(args);
+        if (rv != 0) return rv;
+
+        rv = exchange_recv(&req, resp);
+        if (rv != -ECONNRESET) return rv;
+    }
+    return replay_giving_up(rv);
+}
+
+// Identical requests that don't change anything (a bunch of
+// `watch cat url.txt`es, or everyone stat-ing the same directory) that
+// are in flight at the same time share one exchange: the first one
+// (the leader) goes to the browser, and the rest (followers) wait for
+// its reply and copy it. Keyed by a string that says what makes two
+// requests the same, like "getattr /tabs/by-id/12".
+//
+// A flight lives on the leader's stack, so the leader hangs on until
+// every follower has its copy.
+struct flight {
+    uint64_t hash;
+    const char *key;
+    int done;
+    int rv;
+    // the response message, or the bytes a read got (the leader's)
+    const char *data;
+    size_t size;
+    int refs; // the leader, plus followers who haven't copied yet
+    struct flight *next;
+};
+#define FLIGHT_BUCKETS 64
+static struct flight_bucket {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct flight *head;
+} flights[FLIGHT_BUCKETS] = {
+    [0 ... FLIGHT_BUCKETS-1] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL }
+};
+
+static struct flight_bucket *flight_bucket_for(uint64_t hash) {
+    return &flights[hash % FLIGHT_BUCKETS];
+}
+
+// Joins the flight for key if there is one. If not, starts `mine` and
+// makes us the leader.
+static struct flight *flight_join(struct flight *mine, const char *key, int *leaderp) {
+    uint64_t hash = hash_path(key);
+    struct flight_bucket *b = flight_bucket_for(hash);
+    pthread_mutex_lock(&b->lock);
+    struct flight *f = b->head;
+    while (f && !(f->hash == hash && strcmp(f->key, key) == 0)) f = f->next;
+    if (f) {
+        f->refs++;
+        *leaderp = 0;
+    } else {
+        f = mine;
+        *f = (struct flight) { .hash = hash, .key = key, .refs = 1, .next = b->head };
+        b->head = f;
+        *leaderp = 1;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return f;
+}
+
+// The leader's done: hands data (if it got any) to whoever joined, and
+// waits for them to copy it.
+static void flight_land(struct flight *f, int rv, const char *data, size_t size) {
+    struct flight_bucket *b = flight_bucket_for(f->hash);
+    pthread_mutex_lock(&b->lock);
+    struct flight **pp = &b->head;
+    while (*pp != f) pp = &(*pp)->next;
+    *pp = f->next;
+
+    f->rv = rv;
+    f->data = data;
+    f->size = size;
+    f->done = 1;
+    if (f->refs > 1) {
+        pthread_cond_broadcast(&b->cond);
+        while (f->refs > 1) pthread_cond_wait(&b->cond, &b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Waits for the leader, then copy (with data, size) gets whatever it
+// got. Returns -EAGAIN if the leader got interrupted, which isn't our
+// problem, so we should go on our own.
+static int flight_follow(struct flight *f, void (*copy)(void *ud, const char *data, size_t size),
+                         void *ud) {
+    struct flight_bucket *b = flight_bucket_for(f->hash);
+    int rv = 0;
+    pthread_mutex_lock(&b->lock);
+    while (!f->done) {
+        if (fuse_running && fuse_interrupted()) { rv = -EINTR; break; }
+        cond_wait_ns(&b->cond, &b->lock, fuse_running ? INTERRUPT_POLL_NS : request_timeout_ns);
+    }
+    if (f->done) {
+        rv = f->rv == -EINTR ? -EAGAIN : f->rv;
+        if (rv == 0) copy(ud, f->data, f->size);
+    }
+    if (--f->refs == 1) pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    return rv;
+}
+
+// A response of our own, copied from someone else's.
+struct response_copy {
+    struct response *resp;
+    int rv;
+};
+static void response_copy(void *ud, const char *data, size_t size) {
+    struct response_copy *rc = ud;
+    struct thread_bufs *tb = thread_bufs();
+    char *copy = tb->spare_response;
+    tb->spare_response = NULL;
+    msgbuf_reserve(&copy, size);
+    memcpy(copy, data, size);
+    rc->rv = response_parse(rc->resp, copy, size) == 0 ? 0 : -EIO;
+    if (rc->rv != 0) msgbuf_release(copy);
+}
+
+// do_exchange, but shared with anyone else making the same request
+// (key) at the same time.
+static int do_exchange_shared(struct browser *br, struct response *resp, const char *key,
+                              const char *fmt, ...) {
+    for (;;) {
+        int leader;
+        struct flight mine, *f = flight_join(&mine, key, &leader);
+        if (!leader) {
+            struct response_copy rc = { resp, 0 };
+            int rv = flight_follow(f, response_copy, &rc);
+            if (rv == -EAGAIN) continue;
+
+            va_list args;
+            va_start(args, fmt);
+            stats_add(op_stats[op_of(fmt, args)].coalesced, 1);
+            va_end(args);
+            return rv != 0 ? rv : rc.rv;
+        }
+
+        int rv;
+        for (int tries = 0; tries <= MAX_REPLAYS; tries++) {
+            struct request req = { .stream = NULL };
+            va_list args;
+            va_start(args, fmt);
+            rv = exchange_vsend(br, &req, fmt, args);
+            va_end(args);
+            if (rv == 0) rv = exchange_recv(&req, resp);
+            if (rv != -ECONNRESET) break;
+        }
+        rv = replay_giving_up(rv);
+
+        flight_land(f, rv, rv == 0 ? resp->data : NULL, rv == 0 ? resp->size : 0);
+        return rv;
+    }
+}
+
+// Open files that someone might be waiting on to change: polling (see
+// tabfs_poll) or blocked reading a stream (see read_stream_file). The
+// extension's invalidate messages (below) are what tell us they did.
+struct watch {
+    struct watch *next;
+    struct browser *br;
+    char *path; // (what br calls it)
+    int changed; // since whoever it is last read it from the top
+    int stream, at_end; // stream: reads block at the end for more
+    int ended; // ...unless the extension said there's never any more
+#if FUSE_VERSION >= 28
+    struct fuse_pollhandle *ph; // to wake the kernel's poll with
+#endif
+};
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct watch *head;
+} watches = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL };
+
+static void watch_add(struct watch *w, struct browser *br, const char *path) {
+    w->br = br;
+    w->path = strdup(path);
+    pthread_mutex_lock(&watches.lock);
+    w->next = watches.head;
+    watches.head = w;
+    pthread_mutex_unlock(&watches.lock);
+}
+static void watch_remove(struct watch *w) {
+    if (w->path == NULL) return;
+    pthread_mutex_lock(&watches.lock);
+    struct watch **pp = &watches.head;
+    while (*pp && *pp != w) pp = &(*pp)->next;
+    if (*pp) *pp = w->next;
+#if FUSE_VERSION >= 28
+    if (w->ph) fuse_pollhandle_destroy(w->ph);
+#endif
+    pthread_mutex_unlock(&watches.lock);
+    free(w->path);
+}
+
+// Whether w was marked changed since the last time we asked; clears
+// it.
+static int watch_take_changed(struct watch *w) {
+    pthread_mutex_lock(&watches.lock);
+    int changed = w->changed;
+    w->changed = 0;
+    pthread_mutex_unlock(&watches.lock);
+    return changed;
+}
+
+// Everything open on br at or under path changed.
+static void watches_notify(struct browser *br, const char *path) {
+    size_t len = strlen(path);
+    if (len == 1) len = 0; // ("/": everything)
+    pthread_mutex_lock(&watches.lock);
+    for (struct watch *w = watches.head; w; w = w->next) {
+        if (w->br != br || strncmp(w->path, path, len) != 0 ||
+            (w->path[len] != '\0' && w->path[len] != '/')) continue;
+        w->changed = 1;
+#if FUSE_VERSION >= 28
+        if (w->ph) {
+            fuse_notify_poll(w->ph);
+            fuse_pollhandle_destroy(w->ph);
+            w->ph = NULL;
+        }
+#endif
+    }
+    pthread_cond_broadcast(&watches.changed);
+    pthread_mutex_unlock(&watches.lock);
+}
+
+// Messages the extension sends us on its own, without us asking:
+//
+//   {op: "invalidate", paths: ["/tabs/by-id/12", ...]}
+//     something under each of those paths changed (a tab navigated or
+//     got retitled or closed, a window closed, ...), so stop trusting
+//     what we know about them.
+static void handle_notification(struct browser *br, struct response *resp) {
+    struct json_token op, paths;
+    if (response_scanf(resp, "op: %T", &op) != 1) {
+        eprintln("reader: warning: got a message without an id or op, ignoring");
+        return;
+    }
+
+    if (token_is(op.ptr, op.len, "invalidate") &&
+        response_scanf(resp, "paths: %T", &paths) == 1) {
+        const char *pos = NULL;
+        struct json_token t;
+        while (token_array_next(&paths, &pos, &t)) {
+            // (room for it under /browsers/NAME too; nothing longer than
+            // PATH_MAX is anything the kernel could have asked us about)
+            char path[PATH_MAX];
+            int prefix_len = snprintf(path, sizeof(path), "/browsers/%s", br->name);
+            if (prefix_len + t.len >= (int)sizeof(path)) {
+                eprintln("reader: warning: invalidated path too long (%d bytes), ignoring", t.len);
+                continue;
+            }
+            int path_len = json_unescape(t.ptr, t.len, path + prefix_len, t.len);
+            if (path_len < 0) continue;
+            path[prefix_len + path_len] = '\0';
+            attr_cache_evict_tree(path);
+            attr_cache_evict_tree(path + prefix_len);
+            watches_notify(br, path + prefix_len);
+        }
+
+    } else {
+        eprintln("reader: warning: got unknown message %.*s, ignoring",
+                 (int)op.len, op.ptr);
+    }
+}
+
+// br hung up (in daemon mode; otherwise we're done). Any request it
+// didn't answer is never getting answered, so wake those up to go
+// again once it connects again.
+static void extension_disconnected(struct browser *br) {
+    write_lock_acquire(&br->write_lock, PRIO_HIGH);
+    pthread_mutex_lock(&br->lock);
+    close(br->in);
+    br->in = br->out = -1;
+    uint64_t gen = br->gen++;
+    pthread_cond_broadcast(&br->changed);
+    pthread_mutex_unlock(&br->lock);
+    write_lock_release(&br->write_lock);
+
+    pthread_mutex_lock(&browsers_lock);
+    br->connected = 0;
+    browsers_recount();
+    pthread_mutex_unlock(&browsers_lock);
+
+    for (int i = 0; i < PENDING_BUCKETS; i++) {
+        struct pending_bucket *b = &br->pending[i];
+        pthread_mutex_lock(&b->lock);
+        for (struct request **pp = &b->head; *pp; ) {
+            struct request *req = *pp;
+            if (req->conn_gen != gen) { pp = &req->next; continue; }
+            *pp = req->next;
+            req->lost = 1;
+            req->done = 1;
+            pthread_cond_signal(&req->cond);
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    eprintln("browser %s disconnected", br->name);
+}
+
+// Finds a slot for a browser that just connected as name: the one it
+// had before, if it's reconnecting, or a new one. If another browser
+// by that name is connected right now (two profiles of the same
+// browser, say), this one gets name-2, or name-3, ...
+static struct browser *browser_attach(const char *name, int fd) {
+    struct browser *br = NULL;
+    char candidate[MAX_BROWSER_NAME];
+    snprintf(candidate, sizeof(candidate), "%s", name);
+
+    pthread_mutex_lock(&browsers_lock);
+    for (int n = 2; br == NULL && n < MAX_BROWSERS + 2; n++) {
+        struct browser *found = NULL, *free_slot = NULL;
+        for (int i = 0; i < MAX_BROWSERS; i++) {
+            if (!browsers[i].used) {
+                if (!free_slot) free_slot = &browsers[i];
+            } else if (strcmp(browsers[i].name, candidate) == 0) {
+                found = &browsers[i];
+                break;
+            }
+        }
+        if (found && found->out < 0) {
+            br = found;
+        } else if (found) {
+            snprintf(candidate, sizeof(candidate), "%.*s-%d",
+                     MAX_BROWSER_NAME - 8, name, n);
+        } else if (free_slot) {
+            br = free_slot;
+            snprintf(br->name, sizeof(br->name), "%s", candidate);
+            br->used = 1;
+        } else {
+            break;
+        }
+    }
+    if (br) {
+        br->connected = 1;
+        browsers_recount();
+    }
+    pthread_mutex_unlock(&browsers_lock);
+    if (br == NULL) return NULL;
+
+    // whatever we knew from before might not be true anymore (and
+    // what's at the top level changes with who's connected)
+    attr_cache_evict_tree("/");
+
+    write_lock_acquire(&br->write_lock, PRIO_HIGH);
+    pthread_mutex_lock(&br->lock);
+    br->in = br->out = fd;
+    pthread_cond_broadcast(&br->changed);
+    pthread_mutex_unlock(&br->lock);
+    write_lock_release(&br->write_lock);
+    watches_notify(br, "/");
+
+    stats_add(local_stats.connects, 1);
+    eprintln("browser %s connected", br->name);
+    return br;
+}
+
+// Reads one whole message from fd into *datap. Returns its size, or
+// -1 if the other end went away.
+static ssize_t extension_read(int fd, char **datap) {
+    uint32_t size_4bytes;
+    if (read_all(fd, &size_4bytes, sizeof(size_4bytes)) != 0) return -1;
+    msgbuf_reserve(datap, size_4bytes);
+    if (read_all(fd, *datap, size_4bytes) != 0) return -1;
+    return size_4bytes;
+}
+
+// Reads and dispatches everything br sends us, until it hangs up.
+static void *reader_main(void *ud) {
+    struct browser *br = ud;
+    char *data = NULL;
+    for (;;) {
+        ssize_t insize = extension_read(br->in, &data);
+        if (insize < 0) {
+            if (!daemon_mode) exit(1);
+            extension_disconnected(br);
+            msgbuf_free(data);
+            return NULL;
+        }
+
+        // this is the only pass over the message; the waiting thread
+        // just picks fields out of resp.
+        struct response resp;
+        if (response_parse(&resp, data, insize) != 0) {
+            eprintln("reader: warning: got a malformed message, ignoring");
+            continue;
+        }
+        if (!resp.has_id) {
+            // not a response to anything; the extension telling us
+            // about something on its own.
+            stats_add(local_stats.notifications, 1);
+            handle_notification(br, &resp);
+            continue;
+        }
+        uint64_t id = resp.id;
+        int more = response_get(&resp, "more", 4) != NULL;
+
+        struct pending_bucket *b = bucket_for(br, id);
+        pthread_mutex_lock(&b->lock);
+        struct request **pp = &b->head;
+        while (*pp && (*pp)->id != id) pp = &(*pp)->next;
+        struct request *req = *pp;
+        // (leave it in the table if there's more to come)
+        if (req && !more) *pp = req->next;
+        if (req && more) req->busy = 1;
+        pthread_mutex_unlock(&b->lock);
+
+        if (req == NULL) {
+            eprintln("reader: warning: got a message for nonexistent waiter %llu", (unsigned long long)id);
+            continue;
+        }
+
+        // req can't go away until we set done, so we can do this
+        // without holding the lock.
+        stats_message_in(req->op, insize);
+        if (req->stream) {
+            struct read_stream *stream = req->stream;
+            const struct json_token *t = response_get(&resp, "buf", 3);
+            if (t && t->type == JSON_TYPE_STRING) {
+                stream->len += base64_decode_into(stream->dst + stream->len,
+                    stream->cap - stream->len, t->ptr, t->len);
+            }
+        } else if (more) {
+            eprintln("reader: warning: got a multi-part response to a request that can't take one");
+            req->bad_parts = 1;
+        }
+        if (more) {
+            pthread_mutex_lock(&b->lock);
+            req->busy = 0;
+            pthread_cond_signal(&req->cond);
+            pthread_mutex_unlock(&b->lock);
+            continue;
+        }
+
+        if (req->bad_parts && !resp.has_error) {
+            resp.has_error = 1;
+            resp.error = EIO;
+        }
+
+        pthread_mutex_lock(&b->lock);
+        // hand over what we read, and read the next message into
+        // the waiter's spare buffer (if it had one).
+        req->resp = resp;
+        data = req->spare;
+        req->spare = NULL;
+        req->done = 1;
+        // signal while still holding the lock: once the waiter
+        // sees done, it can return and pop req off its stack.
+        pthread_cond_signal(&req->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+static int count_fmt_args(const char *s) {
+    int cnt = 0;
+    for (; *s; s++) {
+        if (*s == '%') {
+            if (*(s+1) != '%') cnt++;
+            else s++;
+        }
+    }
+    return cnt;
+}
+
+#define exchange_json(br, resp, keys_fmt, ...) \
+    do { \
+        int req_rv = do_exchange(br, resp, keys_fmt, ##__VA_ARGS__); \
+        if (req_rv != 0) return req_rv; \
+    } while (0)
+
+// Picks keys out of a response. On failure, frees the response and
+// returns -EIO from the calling function; on success, the caller
+// still owns the response (for example, to decode a %T token that
+// points into it).
+#define parse_response(resp, keys_fmt, ...) \
+    do { \
+        int num_expected = count_fmt_args(keys_fmt); \
+        int num_scanned = response_scanf(resp, \
+            keys_fmt, \
+            ##__VA_ARGS__); \
+        if (num_scanned != num_expected) { \
+            eprintln("%s: could only parse %d of %d keys!", \
+                __func__, num_expected, num_scanned); \
+            response_free(resp); \
+            return -EIO; \
+        } \
+    } while (0)
+
+#define parse_and_free_response(resp, keys_fmt, ...) \
+    do { \
+        if (*keys_fmt != '\0') { \
+            parse_response(resp, keys_fmt, ##__VA_ARGS__); \
+        } \
+        response_free(resp); \
+    } while (0)
+
+// Names we answer for locally without asking the browser, because
+// nothing in TabFS is ever called that but shells, file managers, and
+// version control prompts look for them in every directory they visit.
+// fnmatch patterns, matched against the last path component.
+// TABFS_DENY (colon-separated) replaces this list.
+static const char *default_deny_patterns[] = {
+    ".git", ".hg", ".svn", ".bzr", "_darcs", "CVS",
+    ".DS_Store", ".Spotlight-V100", ".Trashes", ".Trash", ".Trash-*",
+    ".fseventsd", ".localized", ".metadata_never_index*", ".hidden",
+    ".xdg-volume-info", ".directory", "autorun.inf",
+    "desktop.ini", "Desktop.ini", "Thumbs.db",
+    NULL
+};
+static const char **deny_patterns = default_deny_patterns;
+
+static void deny_patterns_init(const char *spec) {
+    int n = 1;
+    for (const char *p = spec; *p; p++) if (*p == ':') n++;
+
+    char *copy = strdup(spec);
+    const char **patterns = calloc(n + 1, sizeof(*patterns));
+    int i = 0;
+    for (char *tok = strtok(copy, ":"); tok; tok = strtok(NULL, ":")) {
+        patterns[i++] = tok;
+    }
+    deny_patterns = patterns;
+}
+
+// Returns -errno if path is one we shouldn't bother the browser with.
+static int deny_lookup(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    // AppleDouble ._whatever files, where macOS would put xattrs.
+    // ENOTSUP (not ENOENT) tells it not to keep trying to make them.
+    if (name[0] == '.' && name[1] == '_') return -ENOTSUP;
+
+    for (const char **pattern = deny_patterns; *pattern; pattern++) {
+        if (fnmatch(*pattern, name, 0) == 0) return -ENOENT;
+    }
+    return 0;
+}
+
+// Fills in a stat from the st_* keys of a getattr response, or of one
+// of the attrs objects in a readdir response.
+static int stat_from_response(const struct response *resp, struct stat *st) {
+    int mode, nlink;
+    long long size;
+    if (response_scanf(resp, "st_mode: %d, st_nlink: %d, st_size: %lld",
+                       &mode, &nlink, &size) != 3) {
+        return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    st->st_mode = mode;
+    st->st_nlink = nlink;
+    st->st_size = size;
+    return 0;
+}
+
+// Percentile p (0-100) of an op's round trips, in us, from its
+// latency histogram. (The top of the bucket it lands in, so it's an
+// overestimate by up to 2x.)
+static uint64_t stats_percentile_us(const uint64_t *latency, uint64_t n, int p) {
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (n > 0 && seen * 100 >= n * p) return 2ULL << i;
+    }
+    return 0;
+}
+
+struct op_snapshot {
+    struct op_stats s;
+    uint64_t done; // requests that have come back
+};
+static void stats_snapshot(int op, struct op_snapshot *snap) {
+    struct op_stats *s = &op_stats[op];
+    snap->s.requests = stats_get(s->requests);
+    snap->s.errors = stats_get(s->errors);
+    snap->s.timeouts = stats_get(s->timeouts);
+    snap->s.interrupts = stats_get(s->interrupts);
+    snap->s.coalesced = stats_get(s->coalesced);
+    snap->s.in_flight = stats_get(s->in_flight);
+    snap->s.total_ns = stats_get(s->total_ns);
+    snap->s.browser_ns = stats_get(s->browser_ns);
+    snap->s.browser_reports = stats_get(s->browser_reports);
+    snap->s.bytes_out = stats_get(s->bytes_out);
+    snap->s.bytes_in = stats_get(s->bytes_in);
+    snap->s.messages_in = stats_get(s->messages_in);
+    snap->s.max_message_in = stats_get(s->max_message_in);
+    snap->done = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        snap->s.latency[i] = stats_get(s->latency[i]);
+        snap->done += snap->s.latency[i];
+    }
+}
+
+static void stats_render_text(FILE *f) {
+    fprintf(f, "uptime %.1fs\n\n", (now_ns() - stats_start_ns) / 1e9);
+    // all times are averages per request, in us; bridge is the part of
+    // the round trip that wasn't the extension's handler
+    fprintf(f, "%-10s %9s %7s %6s %8s %6s %8s %9s %9s %9s %8s %8s %12s %12s %9s\n",
+            "op", "requests", "shared", "errors", "timeouts", "intr", "inflight",
+            "avg_us", "browser", "bridge", "p50_us", "p99_us",
+            "bytes_out", "bytes_in", "max_in");
+    for (int op = 0; op < NUM_OPS; op++) {
+        struct op_snapshot snap;
+        stats_snapshot(op, &snap);
+        struct op_stats *s = &snap.s;
+        double avg = snap.done ? s->total_ns / 1e3 / snap.done : 0;
+        double browser = s->browser_reports ? s->browser_ns / 1e3 / s->browser_reports : 0;
+        fprintf(f, "%-10s %9llu %6.1f%% %6llu %8llu %6llu %8llu %9.0f %9.0f %9.0f %8llu %8llu %12llu %12llu %9llu\n",
+                op_names[op],
+                (unsigned long long)s->requests,
+                s->coalesced ? 100.0 * s->coalesced / (s->requests + s->coalesced) : 0,
+                (unsigned long long)s->errors,
+                (unsigned long long)s->timeouts, (unsigned long long)s->interrupts,
+                (unsigned long long)s->in_flight,
+                avg, browser, s->browser_reports ? avg - browser : 0,
+                (unsigned long long)stats_percentile_us(s->latency, snap.done, 50),
+                (unsigned long long)stats_percentile_us(s->latency, snap.done, 99),
+                (unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in,
+                (unsigned long long)s->max_message_in);
+    }
+
+    fprintf(f, "\nlatency (count of round trips under each us bound)\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        struct op_snapshot snap;
+        stats_snapshot(op, &snap);
+        if (snap.done == 0) continue;
+        fprintf(f, "%-10s", op_names[op]);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (snap.s.latency[i]) {
+                fprintf(f, " <%llu:%llu", 2ULL << i, (unsigned long long)snap.s.latency[i]);
+            }
+        }
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nanswered locally\n");
+    fprintf(f, "attr cache hits %llu, negative hits %llu, misses %llu\n",
+            (unsigned long long)stats_get(local_stats.attr_hits),
+            (unsigned long long)stats_get(local_stats.attr_negative_hits),
+            (unsigned long long)stats_get(local_stats.attr_misses));
+    fprintf(f, "denied %llu\n", (unsigned long long)stats_get(local_stats.denied));
+    fprintf(f, "notifications from the extension %llu\n",
+            (unsigned long long)stats_get(local_stats.notifications));
+    fprintf(f, "extension connects %llu, requests replayed %llu\n",
+            (unsigned long long)stats_get(local_stats.connects),
+            (unsigned long long)stats_get(local_stats.replays));
+    fprintf(f, "cacheable opens %llu, page cache kept %llu\n",
+            (unsigned long long)stats_get(local_stats.cacheable_opens),
+            (unsigned long long)stats_get(local_stats.kept_opens));
+}
+
+static void stats_render_json(FILE *f) {
+    fprintf(f, "{\"uptime_ns\": %llu, \"ops\": {",
+            (unsigned long long)(now_ns() - stats_start_ns));
+    for (int op = 0; op < NUM_OPS; op++) {
+        struct op_snapshot snap;
+        stats_snapshot(op, &snap);
+        struct op_stats *s = &snap.s;
+        fprintf(f, "%s\n  \"%s\": {\"requests\": %llu, \"errors\": %llu, "
+                "\"coalesced\": %llu, \"timeouts\": %llu, \"interrupts\": %llu, "
+                "\"in_flight\": %llu, \"total_ns\": %llu, "
+                "\"browser_ns\": %llu, \"browser_reports\": %llu, "
+                "\"bytes_out\": %llu, \"bytes_in\": %llu, \"messages_in\": %llu, "
+                "\"max_message_in\": %llu, \"latency_us_log2\": [",
+                op == 0 ? "" : ",", op_names[op],
+                (unsigned long long)s->requests, (unsigned long long)s->errors,
+                (unsigned long long)s->coalesced,
+                (unsigned long long)s->timeouts, (unsigned long long)s->interrupts,
+                (unsigned long long)s->in_flight,
+                (unsigned long long)s->total_ns, (unsigned long long)s->browser_ns,
+                (unsigned long long)s->browser_reports,
+                (unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in,
+                (unsigned long long)s->messages_in, (unsigned long long)s->max_message_in);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            fprintf(f, "%s%llu", i == 0 ? "" : ", ", (unsigned long long)s->latency[i]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "},\n \"attr_cache\": {\"hits\": %llu, \"negative_hits\": %llu, \"misses\": %llu},\n"
+            " \"denied\": %llu, \"notifications\": %llu, \"connects\": %llu, \"replays\": %llu,\n"
+            " \"cacheable_opens\": %llu, \"kept_opens\": %llu}\n",
+            (unsigned long long)stats_get(local_stats.attr_hits),
+            (unsigned long long)stats_get(local_stats.attr_negative_hits),
+            (unsigned long long)stats_get(local_stats.attr_misses),
+            (unsigned long long)stats_get(local_stats.denied),
+            (unsigned long long)stats_get(local_stats.notifications),
+            (unsigned long long)stats_get(local_stats.connects),
+            (unsigned long long)stats_get(local_stats.replays),
+            (unsigned long long)stats_get(local_stats.cacheable_opens),
+            (unsigned long long)stats_get(local_stats.kept_opens));
+}
+
+// /.tabfs is ours: nothing under it goes to the browser. Each file's
+// contents get rendered when you open it (and when you stat it, to
+// get the size).
+static const struct local_node {
+    const char *path;
+    void (*render)(FILE *f); // NULL for directories
+} local_nodes[] = {
+    { "/.tabfs", NULL },
+    { "/.tabfs/stats", NULL },
+    { "/.tabfs/stats/stats.txt", stats_render_text },
+    { "/.tabfs/stats/stats.json", stats_render_json },
+    // (what's in it is whichever browsers are connected; see
+    // local_readdir and browser_for)
+    { "/browsers", NULL },
+};
+#define NUM_LOCAL_NODES (sizeof(local_nodes)/sizeof(*local_nodes))
+
+static int is_local(const char *path) {
+    return (strncmp(path, "/.tabfs", 7) == 0 && (path[7] == '\0' || path[7] == '/')) ||
+        strcmp(path, "/browsers") == 0;
+}
+
+static const struct local_node *local_node_for(const char *path) {
+    for (size_t i = 0; i < NUM_LOCAL_NODES; i++) {
+        if (strcmp(local_nodes[i].path, path) == 0) return &local_nodes[i];
+    }
+    return NULL;
+}
+
+// Returns a malloced buffer (NULL if we ran out of memory).
+static char *local_render(const struct local_node *node, size_t *lenp) {
+    char *data = NULL;
+    FILE *f = open_memstream(&data, lenp);
+    if (f == NULL) return NULL;
+    node->render(f);
+    fclose(f);
+    return data;
+}
+
+static int local_getattr(const char *path, struct stat *st) {
+    const struct local_node *node = local_node_for(path);
+    if (node == NULL) return -ENOENT;
+
+    memset(st, 0, sizeof(*st));
+    if (node->render == NULL) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    size_t len;
+    char *data = local_render(node, &len);
+    if (data == NULL) return -ENOMEM;
+    free(data);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = len;
+    return 0;
+}
+
+static int local_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+    const struct local_node *dir = local_node_for(path);
+    if (dir == NULL) return -ENOENT;
+    if (dir->render != NULL) return -ENOTDIR;
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    size_t len = strlen(path);
+    for (size_t i = 0; i < NUM_LOCAL_NODES; i++) {
+        const char *p = local_nodes[i].path;
+        if (strncmp(p, path, len) == 0 && p[len] == '/' && !strchr(p + len + 1, '/')) {
+            filler(buf, p + len + 1, NULL, 0);
+        }
+    }
+    if (strcmp(path, "/browsers") == 0) {
+        pthread_mutex_lock(&browsers_lock);
+        for (int i = 0; i < MAX_BROWSERS; i++) {
+            if (browsers[i].used && browsers[i].in >= 0) filler(buf, browsers[i].name, NULL, 0);
+        }
+        pthread_mutex_unlock(&browsers_lock);
+    }
+    return 0;
+}
+
+// Which browser a path is about, and the path to ask it about. With
+// one browser connected (the usual), it's that one, and paths go as
+// is. Every browser's tree is also at /browsers/NAME. With more than
+// one, the top level is all of theirs on top of each other (see
+// merged_getattr and merged_readdir; the first to connect wins where
+// they clash), and /browsers/NAME is how you say which one you mean.
+// (With none, it's the merged view too, which waits for whoever
+// connects next.)
+//
+// Sets *brp to NULL for the merged view. Returns -ENOENT for a
+// browser we've never heard of.
+static const char *path_in_browser(const char *path) {
+    if (strncmp(path, "/browsers/", 10) != 0) return path;
+    const char *rest = strchr(path + 10, '/');
+    return rest ? rest : "/";
+}
+static int browser_for(const char *path, struct browser **brp, const char **bpathp) {
+    *bpathp = path_in_browser(path);
+    if (*bpathp == path) {
+        *brp = __atomic_load_n(&sole_browser, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    const char *name = path + 10, *end = strchr(name, '/');
+    size_t name_len = end ? (size_t)(end - name) : strlen(name);
+    *brp = NULL;
+    pthread_mutex_lock(&browsers_lock);
+    for (int i = 0; i < MAX_BROWSERS; i++) {
+        if (browsers[i].used && strncmp(browsers[i].name, name, name_len) == 0 &&
+            browsers[i].name[name_len] == '\0') {
+            *brp = &browsers[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&browsers_lock);
+    return *brp ? 0 : -ENOENT;
+}
+
+// Sends the same request to every connected browser at once, for the
+// merged view. (If none is connected, waits a while for one to be.)
+struct fan_out {
+    int n;
+    struct browser *br[MAX_BROWSERS];
+    struct request req[MAX_BROWSERS];
+    struct response resp[MAX_BROWSERS];
+    int rv[MAX_BROWSERS];
+};
+static int fan_out(struct fan_out *fo, const char *fmt, ...) {
+    fo->n = 0;
+    pthread_mutex_lock(&browsers_lock);
+    int rv = wait_for_connect(&browsers_lock, &browsers_changed, any_connected, NULL);
+    for (int i = 0; rv == 0 && i < MAX_BROWSERS; i++) {
+        if (browsers[i].used && browsers[i].in >= 0) fo->br[fo->n++] = &browsers[i];
+    }
+    pthread_mutex_unlock(&browsers_lock);
+    if (rv != 0) return rv;
+
+    for (int i = 0; i < fo->n; i++) {
+        fo->req[i] = (struct request) { .stream = NULL };
+        va_list args;
+        va_start(args, fmt);
+        fo->rv[i] = exchange_vsend(fo->br[i], &fo->req[i], fmt, args);
+        va_end(args);
+    }
+    for (int i = 0; i < fo->n; i++) {
+        if (fo->rv[i] == 0) fo->rv[i] = exchange_recv(&fo->req[i], &fo->resp[i]);
+    }
+    return 0;
+}
+static void fan_out_free(struct fan_out *fo) {
+    for (int i = 0; i < fo->n; i++) {
+        if (fo->rv[i] == 0) response_free(&fo->resp[i]);
+    }
+}
+// Hands over the response of the first browser that answered without
+// an error (for the caller to free), frees the rest, and returns which
+// one that was. Or -errno (the first browser's) if none did.
+static int fan_out_take_first(struct fan_out *fo, struct response *resp) {
+    int first = fo->n > 0 ? fo->rv[0] : -ENOENT;
+    for (int i = 0; i < fo->n; i++) {
+        if (fo->rv[i] == 0) {
+            *resp = fo->resp[i];
+            fo->rv[i] = -1;
+            first = i;
+            break;
+        }
+    }
+    fan_out_free(fo);
+    return first;
+}
+
+// For the ops that go to just one browser: the browser path is in, or
+// in the merged view, the first one that has path (or has its parent,
+// if we're making path).
+static int browser_owning(const char *path, int parent,
+                          struct browser **brp, const char **bpathp) {
+    int rv = browser_for(path, brp, bpathp);
+    if (rv != 0 || *brp != NULL) return rv;
+
+    char lookup[strlen(path) + 2];
+    strcpy(lookup, path);
+    if (parent) {
+        char *slash = strrchr(lookup, '/');
+        if (slash == lookup) slash[1] = '\0';
+        else if (slash) *slash = '\0';
+    }
+    struct fan_out fo;
+    struct response resp;
+    rv = fan_out(&fo, "op: %Q, path: %Q", "getattr", lookup);
+    if (rv != 0) return rv;
+    int i = fan_out_take_first(&fo, &resp);
+    if (i < 0) return i;
+    response_free(&resp);
+    *brp = fo.br[i];
+    return 0;
+}
+
+static int tabfs_getattr(const char *path, struct stat *stbuf) {
+    if (is_local(path)) return local_getattr(path, stbuf);
+
+    int rv = deny_lookup(path);
+    if (rv != 0) {
+        stats_add(local_stats.denied, 1);
+        return rv;
+    }
 
-    struct resumedata mydata = {
-        .id = id,
-        .msgpipe = {-1, -1},
-        .data = NULL,
-        .size = 0,
-    };
-    if (-1 == pipe(mydata.msgpipe)) {
-        perror("exchange: pipe");
-        free(jsonbuf);
+    rv = attr_cache_get(path, stbuf);
+    if (rv > 0) {
+        stats_add(local_stats.attr_hits, 1);
+        return 0;
+    }
+    if (rv < 0) {
+        stats_add(local_stats.attr_negative_hits, 1);
+        return rv;
+    }
+    stats_add(local_stats.attr_misses, 1);
+    uint64_t gen = attr_cache_generation();
+
+    struct browser *br;
+    const char *bpath;
+    rv = browser_for(path, &br, &bpath);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    if (br == NULL) {
+        // merged view: the first browser that has it
+        struct fan_out fo;
+        rv = fan_out(&fo, "op: %Q, path: %Q", "getattr", bpath);
+        if (rv == 0) {
+            int i = fan_out_take_first(&fo, &resp);
+            if (i < 0) rv = i;
+        }
+    } else {
+        char key[strlen(bpath) + 32];
+        sprintf(key, "getattr %d %s", (int)(br - browsers), bpath);
+        rv = do_exchange_shared(br, &resp, key,
+            "op: %Q, path: %Q",
+            "getattr", bpath);
+    }
+    if (rv == -ENOENT) attr_cache_put_error(path, ENOENT, gen);
+    if (rv != 0) return rv;
+
+    rv = stat_from_response(&resp, stbuf);
+    response_free(&resp);
+    if (rv != 0) {
+        eprintln("%s: couldn't parse attributes!", __func__);
         return -EIO;
     }
 
-    pthread_mutex_lock(&write_lock);
+    attr_cache_put(path, stbuf, gen);
+    return 0;
+}
 
-    uint32_t size_4bytes = request_size;
+static int tabfs_readlink(const char *path, char *buf, size_t size) {
+    if (is_local(path)) return -EINVAL;
 
-    write_or_die(STDOUT_FILENO, &size_4bytes, sizeof(size_4bytes));
-    write_or_die(STDOUT_FILENO, jsonbuf, request_size);
+    struct browser *br;
+    int rv = browser_owning(path, 0, &br, &path);
+    if (rv != 0) return rv;
 
-    free(jsonbuf); jsonbuf = NULL;
+    char key[strlen(path) + 32];
+    sprintf(key, "readlink %d %s", (int)(br - browsers), path);
+    struct response resp;
+    rv = do_exchange_shared(br, &resp, key,
+        "op: %Q, path: %Q",
+        "readlink", path);
+    if (rv != 0) return rv;
 
-    waiters = realloc(waiters, (numwaiters+1)*sizeof(*waiters));
-    waiters[numwaiters] = &mydata;
-    numwaiters += 1;
+    struct json_token scan_tok;
+    parse_response(&resp,
+        "buf: %T",
+        &scan_tok);
 
-    pthread_mutex_unlock(&write_lock);
+    // fuse.h:
+    // "If the linkname is too long to fit in the buffer, it should be truncated."
+    size_t len = base64_decode_into(buf, size-1, scan_tok.ptr, scan_tok.len);
+    buf[len] = '\0';
 
-    char c;
-    read_or_die(mydata.msgpipe[0], &c, 1);
+    response_free(&resp);
 
-    close(mydata.msgpipe[0]);
-    close(mydata.msgpipe[1]);
+    return 0;
+}
 
-    int err;
-    if (1 == json_scanf(mydata.data, mydata.size, "{error: %d}", &err)) {
-        free(mydata.data);
-        return -err;
-    }
+// An open file. fi->fh points to one of these, and the extension's own
+// handle for the file is in here, along with read-ahead state.
+//
+// Read-ahead: once reads on a file look sequential (like cp, or cat of
+// a big resource), we stop asking the extension for each FUSE-sized
+// read and ask for a whole window of the file at a time. Windows start
+// at READAHEAD_MIN and double up to readahead_max. As soon as we start
+// handing out one window, we ask for the next one, so the browser is
+// encoding and sending it while we copy this one out read by read.
+#define READAHEAD_MIN (128*1024)
+static size_t readahead_max = 4*1024*1024;
+
+struct readahead_window {
+    char *data; // msgbuf
+    off_t offset;
+    size_t len;
+    size_t asked; // if len < asked, the file ends at offset + len
+};
 
-    *datap = mydata.data;
-    *sizep = mydata.size;
+struct open_file {
+    struct browser *br; // (the extension's handle is only good there)
+    uint64_t fh;
+    pthread_mutex_t lock;
+
+    off_t next_offset; // where the next read will start if it's sequential
+    size_t readahead;  // how big a window to ask for next
+    struct readahead_window cur;
+
+    // the next window, if we've asked for it
+    int prefetching;
+    struct readahead_window next;
+    struct request next_req;
+    struct read_stream next_stream;
+
+    // opened O_RDONLY, so its reads can be shared (see read_shared)
+    int readonly;
+    // written or truncated through this handle, so there's something
+    // for flush and fsync to hand over (otherwise closing a file you
+    // just read doesn't cost a round trip)
+    int written;
+
+    // (not for ours under /.tabfs, which never change)
+    struct watch watch;
+    int poll_sent; // see watch_start
+
+    // contents, if it's one of our own files under /.tabfs
+    char *local;
+    size_t local_len;
+};
 
-    return 0;
+static struct open_file *open_file_for(struct fuse_file_info *fi) {
+    return (struct open_file *)(uintptr_t)fi->fh;
 }
 
-static void *reader_main(void *ud) {
-    (void)ud;
-    for (;;) {
-        uint32_t size_4bytes;
-        read_or_die(STDIN_FILENO, &size_4bytes, sizeof(size_4bytes));
-        size_t insize = size_4bytes;
+static int send_read(struct request *req, struct read_stream *stream,
+                     const char *path, struct open_file *of,
+                     char *dst, size_t size, off_t offset) {
+    *stream = (struct read_stream) { dst, size, 0 };
+    req->stream = stream;
+    return exchange_send(of->br, req,
+        "op: %Q, path: %Q, size: %llu, offset: %lld, fh: %llu",
+        "read", path, (unsigned long long)size, (long long)offset, of->fh);
+}
 
-        char *data = malloc(insize);
-        read_or_die(STDIN_FILENO, data, insize);
+// Returns how many bytes ended up in the stream's dst, or -errno.
+static int recv_read(struct request *req, struct read_stream *stream) {
+    struct response resp;
+    int rv = exchange_recv(req, &resp);
+    if (rv != 0) return rv;
+    // An empty read with `eof: true` is the end of a stream, for good
+    // (see read_stream_file). It goes around as an error, so whoever's
+    // sharing this read hears about it, too.
+    int eof = 0;
+    if (stream->len == 0) response_scanf(&resp, "eof: %B", &eof);
+    response_free(&resp);
+    if (eof) return -ENODATA;
+    return stream->len;
+}
 
-        unsigned int id;
-        if (1 != json_scanf(data, insize, "{id: %u}", &id)) {
-            eprintln("reader: warning: got a message without an id, ignoring");
-            free(data);
-            continue;
-        }
+// send_read then recv_read, but shared with anyone else reading the
+// same bytes of the same file at the same time, as long as none of us
+// opened it to write. (Their read goes to their own open of the file,
+// but opens that close together share one getData on the extension's
+// end anyway.)
+struct read_copy {
+    char *dst;
+    int len;
+};
+static void read_copy(void *ud, const char *data, size_t size) {
+    struct read_copy *rc = ud;
+    memcpy(rc->dst, data, size);
+    rc->len = size;
+}
 
-        pthread_mutex_lock(&write_lock);
-        int found = 0;
-        unsigned int i = numwaiters;
-        while (i --> 0) {
-            if (waiters[i]->id == id) {
-                char c = '!';
-                waiters[i]->data = data;
-                waiters[i]->size = insize;
-                write_or_die(waiters[i]->msgpipe[1], &c, 1);
-                memmove(&waiters[i], &waiters[i+1],
-                    (numwaiters-(i+1))*sizeof(*waiters));
-                numwaiters -= 1;
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            eprintln("reader: warning: got a message for nonexistent waiter %u", id);
-            free(data);
+static int read_shared(const char *path, struct open_file *of,
+                       char *dst, size_t size, off_t offset) {
+    char key[strlen(path) + 80];
+    sprintf(key, "read %d %lld %zu %s",
+            (int)(of->br - browsers), (long long)offset, size, path);
+    for (;;) {
+        int leader = 1;
+        struct flight mine, *f = of->readonly ? flight_join(&mine, key, &leader) : NULL;
+        if (!leader) {
+            struct read_copy rc = { dst, 0 };
+            int rv = flight_follow(f, read_copy, &rc);
+            if (rv == -EAGAIN) continue;
+            stats_add(op_stats[OP_READ].coalesced, 1);
+            return rv != 0 ? rv : rc.len;
         }
-        pthread_mutex_unlock(&write_lock);
-    }
-    return NULL;
-}
 
-static int count_fmt_args(const char *s) {
-    int cnt = 0;
-    for (; *s; s++) {
-        if (*s == '%') {
-            if (*(s+1) != '%') cnt++;
-            else s++;
+        int rv;
+        for (int tries = 0; tries <= MAX_REPLAYS; tries++) {
+            struct request req;
+            struct read_stream stream;
+            rv = send_read(&req, &stream, path, of, dst, size, offset);
+            if (rv == 0) rv = recv_read(&req, &stream);
+            if (rv != -ECONNRESET) break;
         }
+        rv = replay_giving_up(rv);
+        if (f) flight_land(f, rv < 0 ? rv : 0, dst, rv < 0 ? 0 : rv);
+        return rv;
     }
-    return cnt;
 }
 
-#define exchange_json(datap, sizep, keys_fmt, ...) \
-    do { \
-        unsigned int id = (uintptr_t)pthread_self(); \
-        int req_rv = do_exchange(id, datap, sizep, \
-            "{id: %u, " keys_fmt "}", \
-            id, ##__VA_ARGS__); \
-        if (req_rv != 0) return req_rv; \
-    } while (0)
-
-#define parse_and_free_response(data, size, keys_fmt, ...) \
-    do { \
-        if (*keys_fmt == '\0') { \
-            /* empty format string, skip the work */ \
-            free(data); data = NULL; \
-        } else { \
-            int num_expected = count_fmt_args(keys_fmt); \
-            int num_scanned = json_scanf(data, size, \
-                "{" keys_fmt "}", \
-                ##__VA_ARGS__); \
-            if (num_scanned == num_expected) { \
-                free(data); data = NULL; \
-            } else { \
-                eprintln("%s: could only parse %d of %d keys!", \
-                    __func__, num_expected, num_scanned); \
-                free(data); data = NULL; \
-                return -EIO; \
-            } \
-        } \
-    } while (0)
-
-static int tabfs_getattr(const char *path, struct stat *stbuf) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
-        "op: %Q, path: %Q",
-        "getattr", path);
-
-    memset(stbuf, 0, sizeof(struct stat));
-    parse_and_free_response(rdata, rsize,
-        "st_mode: %d, st_nlink: %d, st_size: %d",
-        &stbuf->st_mode, &stbuf->st_nlink, &stbuf->st_size);
-
+static int read_window(const char *path, struct open_file *of,
+                       struct readahead_window *w, size_t size, off_t offset) {
+    msgbuf_reserve(&w->data, size);
+    w->offset = offset;
+    w->len = 0;
+    w->asked = 0;
+    int rv = read_shared(path, of, w->data, size, offset);
+    if (rv < 0) return rv;
+    w->len = rv;
+    w->asked = size;
     return 0;
 }
 
-static int tabfs_readlink(const char *path, char *buf, size_t size) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
-        "op: %Q, path: %Q",
-        "readlink", path);
-
-    char *scan_buf;
-    int scan_len;
-    parse_and_free_response(rdata, rsize,
-        "buf: %V",
-        &scan_buf, &scan_len);
-
-    // fuse.h:
-    // "If the linkname is too long to fit in the buffer, it should be truncated."
-    if ((size_t)scan_len >= size) scan_len = size-1;
+static void readahead_start(const char *path, struct open_file *of, off_t offset) {
+    struct readahead_window *w = &of->next;
+    size_t size = of->readahead;
+    msgbuf_reserve(&w->data, size);
+    w->offset = offset;
+    w->len = 0;
+    w->asked = size;
+    if (send_read(&of->next_req, &of->next_stream, path, of,
+                  w->data, size, offset) == 0) {
+        of->prefetching = 1;
+    }
+    if (of->readahead < readahead_max) of->readahead *= 2;
+}
 
-    memcpy(buf, scan_buf, scan_len);
-    buf[scan_len] = '\0';
+// Waits for the window we asked for, and makes it the current one.
+static int readahead_finish(struct open_file *of) {
+    of->prefetching = 0;
+    int rv = recv_read(&of->next_req, &of->next_stream);
+
+    struct readahead_window tmp = of->cur;
+    of->cur = of->next;
+    of->next = tmp;
+    if (rv < 0) {
+        of->cur.len = of->cur.asked = 0;
+        // (lost to a reconnect: tabfs_read will just read it again)
+        return rv == -ECONNRESET ? 0 : rv;
+    }
+    of->cur.len = rv;
+    return 0;
+}
 
-    free(scan_buf);
+// Throws away everything we've read ahead (say, because the file got
+// written).
+static void readahead_drop(struct open_file *of) {
+    if (of->prefetching) readahead_finish(of);
+    of->cur.len = of->cur.asked = 0;
+    of->next_offset = -1;
+}
 
-    return 0;
+// Most files' contents change without their names changing (url.txt,
+// text.txt, ...), so they're direct_io: every read comes to us, and on
+// to the browser. But the extension can say, in its open response,
+// that a file's contents are one fixed thing, named by a version:
+// {fh, cache: true, version: "..."} (a script's source, say). Then the
+// kernel can keep its pages (and you can mmap it), and as long as the
+// version's the same the next time it's opened, it keeps them from
+// one open to the next, too (keep_cache).
+//
+// We remember the last version of each path, by hash of path, direct
+// mapped; forgetting one just means reading the file over again.
+#define PAGE_VERSIONS 4096
+static struct {
+    uint64_t path_hash, version_hash;
+} page_versions[PAGE_VERSIONS];
+static pthread_mutex_t page_versions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether what the kernel has of path is still good, now that it's at
+// version. Remembers version for next time.
+static int page_version_same(const char *path, const struct json_token *version) {
+    uint64_t path_hash = hash_path(path);
+    uint64_t version_hash = hash_bytes(version->ptr, version->len);
+    pthread_mutex_lock(&page_versions_lock);
+    int i = path_hash % PAGE_VERSIONS;
+    int same = page_versions[i].path_hash == path_hash &&
+        page_versions[i].version_hash == version_hash;
+    page_versions[i].path_hash = path_hash;
+    page_versions[i].version_hash = version_hash;
+    pthread_mutex_unlock(&page_versions_lock);
+    return same;
 }
 
 static int tabfs_open(const char *path, struct fuse_file_info *fi) {
-    char *data;
-    size_t size;
-    exchange_json(&data, &size,
+    if (is_local(path)) {
+        const struct local_node *node = local_node_for(path);
+        if (node == NULL) return -ENOENT;
+        if (node->render == NULL) return -EISDIR;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+        struct open_file *of = calloc(1, sizeof(*of));
+        of->local = local_render(node, &of->local_len);
+        if (of->local == NULL) {
+            free(of);
+            return -ENOMEM;
+        }
+        pthread_mutex_init(&of->lock, NULL);
+        fi->fh = (uintptr_t)of;
+        // (rendered fresh each open, and st_size doesn't know how big)
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    const char *fuse_path = path;
+    struct browser *br;
+    int rv = browser_owning(path, (fi->flags & O_CREAT) != 0, &br, &path);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, flags: %d",
         "open", path, fi->flags);
 
-    parse_and_free_response(data, size,
-        "fh: %llu",
-        &fi->fh);
+    // (all of it before we allocate anything, since parse_response
+    // returns on failure)
+    uint64_t fh;
+    parse_response(&resp, "fh: %llu", &fh);
+    int readonly = (fi->flags & O_ACCMODE) == O_RDONLY;
+
+    // A stream (like a tab's events.jsonl) is one where reading at the
+    // end waits for more, like a pipe, instead of being the end.
+    int stream = 0;
+    response_scanf(&resp, "stream: %B", &stream);
+
+    int cache = 0;
+    struct json_token version = { NULL, 0, JSON_TYPE_INVALID };
+    response_scanf(&resp, "cache: %B, version: %T", &cache, &version);
+    fi->direct_io = 1;
+    if (cache && version.ptr && readonly && !stream) {
+        fi->direct_io = 0;
+        fi->keep_cache = page_version_same(fuse_path, &version);
+        stats_add(local_stats.cacheable_opens, 1);
+        if (fi->keep_cache) stats_add(local_stats.kept_opens, 1);
+    }
+    response_free(&resp);
+
+    struct open_file *of = calloc(1, sizeof(*of));
+    of->br = br;
+    of->fh = fh;
+    pthread_mutex_init(&of->lock, NULL);
+    of->readahead = READAHEAD_MIN;
+    of->readonly = readonly;
+    of->watch.stream = stream;
+    fi->fh = (uintptr_t)of;
+    watch_add(&of->watch, br, path);
 
     return 0;
 }
 
+// Tells the extension someone's waiting on this file to change, the
+// first time they do, for files where it has to go out of its way to
+// notice (like watches, which it then evaluates every so often on its
+// end instead of us asking over and over).
+static void watch_start(struct open_file *of, const char *path) {
+    pthread_mutex_lock(&of->lock);
+    int sent = of->poll_sent;
+    of->poll_sent = 1;
+    pthread_mutex_unlock(&of->lock);
+    if (sent) return;
+
+    struct response resp;
+    if (do_exchange(of->br, &resp, "op: %Q, path: %Q, fh: %llu",
+                    "poll", path, of->fh) == 0) {
+        response_free(&resp);
+    }
+}
+
+// Reading a stream: whatever's there past offset, or if there's
+// nothing yet, wait for the extension to say there's more.
+static int read_stream_file(const char *path, struct open_file *of,
+                            char *buf, size_t size, off_t offset, int flags) {
+    for (;;) {
+        watch_take_changed(&of->watch);
+        int rv = read_shared(path, of, buf, size, offset);
+        int ended = rv == -ENODATA;
+        if (ended) rv = 0;
+
+        pthread_mutex_lock(&watches.lock);
+        of->watch.at_end = rv == 0 && !ended;
+        of->watch.ended = ended;
+        pthread_mutex_unlock(&watches.lock);
+        if (rv != 0 || ended) return rv;
+        if (flags & O_NONBLOCK) return -EAGAIN;
+
+        watch_start(of, path);
+        pthread_mutex_lock(&watches.lock);
+        while (!of->watch.changed && rv == 0) {
+            if (fuse_running && fuse_interrupted()) rv = -EINTR;
+            else cond_wait_ns(&watches.changed, &watches.lock, INTERRUPT_POLL_NS);
+        }
+        pthread_mutex_unlock(&watches.lock);
+        if (rv != 0) return rv;
+    }
+}
+
 static int tabfs_read(const char *path,
                       char *buf,
                       size_t size,
                       off_t offset,
                       struct fuse_file_info *fi) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
-        "op: %Q, path: %Q, size: %d, offset: %lld, fh: %llu, flags: %d",
-        "read", path, size, offset, fi->fh, fi->flags);
+    struct open_file *of = open_file_for(fi);
+    if (of->local) {
+        if (offset >= (off_t)of->local_len) return 0;
+        if (size > of->local_len - offset) size = of->local_len - offset;
+        memcpy(buf, of->local + offset, size);
+        return size;
+    }
+    path = path_in_browser(path);
+    if (of->watch.stream) return read_stream_file(path, of, buf, size, offset, fi->flags);
+    pthread_mutex_lock(&of->lock);
+    // rereading from the top after it changed: don't hand out what we
+    // read ahead before
+    if (offset == 0 && watch_take_changed(&of->watch)) readahead_drop(of);
+
+    int sequential = offset == of->next_offset && readahead_max > 0;
+    if (!sequential) of->readahead = READAHEAD_MIN;
+
+    size_t done = 0;
+    int rv = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        struct readahead_window *w = &of->cur;
+        if (pos >= w->offset && pos < w->offset + (off_t)w->len) {
+            size_t n = w->offset + w->len - pos;
+            if (n > size - done) n = size - done;
+            memcpy(buf + done, w->data + (pos - w->offset), n);
+            done += n;
+            continue;
+        }
+        if (pos == w->offset + (off_t)w->len && w->len < w->asked) {
+            break; // end of file
+        }
+
+        if (of->prefetching) {
+            // probably the window we need
+            rv = readahead_finish(of);
+            if (rv < 0) break;
+            if (of->cur.offset == pos) continue;
+        }
+
+        if (!sequential) {
+            // just this read, straight into FUSE's buffer
+            rv = read_shared(path, of, buf + done, size - done, pos);
+            if (rv > 0) done += rv;
+            break;
+        }
+
+        size_t window = of->readahead;
+        if (window < size - done) window = size - done;
+        rv = read_window(path, of, w, window, pos);
+        if (rv < 0) break;
+        if (of->readahead < readahead_max) of->readahead *= 2;
+    }
 
-    char *scan_buf; int scan_len;
-    parse_and_free_response(rdata, rsize,
-        "buf: %V",
-        &scan_buf, &scan_len);
+    // get the browser started on the next window while we hand this
+    // one out
+    struct readahead_window *w = &of->cur;
+    if (sequential && done > 0 && !of->prefetching && w->len == w->asked &&
+        offset + (off_t)done > w->offset) {
+        readahead_start(path, of, w->offset + w->len);
+    }
 
-    if ((size_t)scan_len > size) scan_len = size;
-    memcpy(buf, scan_buf, scan_len);
-    free(scan_buf);
+    of->next_offset = offset + done;
+    pthread_mutex_unlock(&of->lock);
 
-    return scan_len;
+    return done > 0 ? (int)done : rv;
 }
 
 static int tabfs_write(const char *path,
@@ -295,46 +2700,249 @@ static int tabfs_write(const char *path,
                        size_t size,
                        off_t offset,
                        struct fuse_file_info *fi) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    attr_cache_evict(path);
+
+    struct open_file *of = open_file_for(fi);
+    pthread_mutex_lock(&of->lock);
+    readahead_drop(of);
+    of->written = 1;
+    pthread_mutex_unlock(&of->lock);
+
+    struct response resp;
+    exchange_json(of->br, &resp,
         "op: %Q, path: %Q, buf: %V, offset: %lld, fh: %llu, flags: %d",
-        "write", path, data, size, offset, fi->fh, fi->flags);
+        "write", path_in_browser(path), data, size, offset, of->fh, fi->flags);
 
     int ret;
-    parse_and_free_response(rdata, rsize,
+    parse_and_free_response(&resp,
         "size: %d",
         &ret);
 
     return ret;
 }
 
+// The extension holds on to writes in the open file's buffer and only
+// commits them (runs the setData for the file, which might be
+// recompiling a script or running an eval) when the file is flushed,
+// which happens on every close(), or fsynced. So this is where errors
+// from actually doing the write come back.
+static int open_file_written(struct open_file *of) {
+    pthread_mutex_lock(&of->lock);
+    int written = of->written;
+    pthread_mutex_unlock(&of->lock);
+    return written;
+}
+
+static int tabfs_flush(const char *path, struct fuse_file_info *fi) {
+    if (open_file_for(fi)->local) return 0;
+    if (open_file_for(fi)->readonly || !open_file_written(open_file_for(fi))) return 0;
+    attr_cache_evict(path);
+
+    struct response resp;
+    exchange_json(open_file_for(fi)->br, &resp,
+        "op: %Q, path: %Q, fh: %llu",
+        "flush", path_in_browser(path), open_file_for(fi)->fh);
+
+    parse_and_free_response(&resp, "");
+
+    return 0;
+}
+
+static int tabfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (open_file_for(fi)->local) return 0;
+    if (open_file_for(fi)->readonly || !open_file_written(open_file_for(fi))) return 0;
+    attr_cache_evict(path);
+
+    struct response resp;
+    exchange_json(open_file_for(fi)->br, &resp,
+        "op: %Q, path: %Q, fh: %llu, datasync: %d",
+        "fsync", path_in_browser(path), open_file_for(fi)->fh, datasync);
+
+    parse_and_free_response(&resp, "");
+
+    return 0;
+}
+
 static int tabfs_release(const char *path, struct fuse_file_info *fi) {
-    char *data;
-    size_t size;
-    exchange_json(&data, &size,
+    struct open_file *of = open_file_for(fi);
+    // (the reader thread might still be writing into the next window)
+    readahead_drop(of);
+    watch_remove(&of->watch);
+    struct browser *br = of->br;
+    uint64_t fh = of->fh;
+    int local = of->local != NULL;
+    free(of->local);
+    msgbuf_free(of->cur.data);
+    msgbuf_free(of->next.data);
+    pthread_mutex_destroy(&of->lock);
+    free(of);
+    if (local) return 0;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, fh: %llu",
-        "release", path, fi->fh);
+        "release", path_in_browser(path), fh);
+
+    parse_and_free_response(&resp, "");
 
-    parse_and_free_response(data, size, "");
+    return 0;
+}
+
+#if FUSE_VERSION >= 28
+// Files are always readable, since reads don't wait (like regular
+// files), except streams at their end. On top of that, like sysfs
+// attributes, a file that changed since you last read it from the top
+// is POLLPRI. So poll() for POLLPRI (or select() for exceptions) on
+// url.txt, or a watch, and reread when it wakes you up.
+static int tabfs_poll(const char *path, struct fuse_file_info *fi,
+                      struct fuse_pollhandle *ph, unsigned *reventsp) {
+    struct open_file *of = open_file_for(fi);
+    if (of->local) {
+        if (ph) fuse_pollhandle_destroy(ph);
+        *reventsp = POLLIN | POLLRDNORM;
+        return 0;
+    }
+    watch_start(of, path_in_browser(path));
 
+    pthread_mutex_lock(&watches.lock);
+    struct watch *w = &of->watch;
+    if (ph) {
+        if (w->ph) fuse_pollhandle_destroy(w->ph);
+        w->ph = ph;
+    }
+    if (w->stream) {
+        *reventsp = w->changed || !w->at_end ? POLLIN | POLLRDNORM : 0;
+        if (w->ended) *reventsp |= POLLHUP;
+    } else {
+        *reventsp = POLLIN | POLLRDNORM | (w->changed ? POLLPRI : 0);
+    }
+    pthread_mutex_unlock(&watches.lock);
     return 0;
 }
+#endif
 
 static int tabfs_opendir(const char *path, struct fuse_file_info *fi) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) {
+        fi->fh = 0;
+        return 0;
+    }
+
+    struct browser *br;
+    int rv = browser_for(path, &br, &path);
+    if (rv != 0) return rv;
+    if (br == NULL) {
+        // merged view: open it wherever it is (no handle, but that's
+        // fine, since the extension never gives directories one)
+        struct fan_out fo;
+        struct response resp;
+        rv = fan_out(&fo, "op: %Q, path: %Q, flags: %d", "opendir", path, fi->flags);
+        if (rv == 0) rv = fan_out_take_first(&fo, &resp);
+        if (rv < 0) return rv;
+        response_free(&resp);
+        fi->fh = 0;
+        return 0;
+    }
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, flags: %d",
         "opendir", path, fi->flags);
 
-    parse_and_free_response(rdata, rsize,
+    parse_and_free_response(&resp,
         "fh: %llu",
         &fi->fh);
 
     return 0;
 }
 
+// The names a merged readdir has handed FUSE so far, so the next
+// browser's copies of them can be left out. Open addressing, by hash.
+struct name_set {
+    struct name_slot { uint64_t hash; char *name; } *slots;
+    size_t cap, n;
+};
+// 1 if name is new (and now in the set), 0 if it was there already.
+static int name_set_add(struct name_set *set, const char *name) {
+    if ((set->n + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 64;
+        struct name_slot *slots = calloc(cap, sizeof(*slots));
+        if (slots == NULL) return 1; // (just don't dedup)
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->slots[i].name == NULL) continue;
+            size_t j = set->slots[i].hash & (cap - 1);
+            while (slots[j].name) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+    uint64_t hash = hash_path(name);
+    size_t i = hash & (set->cap - 1);
+    for (; set->slots[i].name; i = (i + 1) & (set->cap - 1)) {
+        if (set->slots[i].hash == hash && strcmp(set->slots[i].name, name) == 0) return 0;
+    }
+    set->slots[i].name = strdup(name);
+    if (set->slots[i].name == NULL) return 1;
+    set->slots[i].hash = hash;
+    set->n++;
+    return 1;
+}
+static void name_set_free(struct name_set *set) {
+    for (size_t i = 0; i < set->cap; i++) free(set->slots[i].name);
+    free(set->slots);
+}
+
+// Hands FUSE the entries of a readdir response for path. In the merged
+// view, seen has what other browsers already had, and those get left
+// out.
+//
+// The extension can send an `attrs` array alongside `entries`, with
+// attributes (or null) for each entry, for readdirs where those are
+// cheap for it to figure out. We hand them to FUSE and keep them
+// around for the getattrs that tend to follow.
+static int readdir_fill(const char *path, struct response *resp, uint64_t gen,
+                        void *buf, fuse_fill_dir_t filler,
+                        struct name_set *seen) {
+    struct json_token entries, attrs = { NULL, 0, JSON_TYPE_INVALID };
+    if (response_scanf(resp, "entries: %T", &entries) != 1) {
+        eprintln("%s: couldn't parse entries!", __func__);
+        return -EIO;
+    }
+    response_scanf(resp, "attrs: %T", &attrs);
+
+    size_t path_len = strlen(path);
+    const char *entries_pos = NULL, *attrs_pos = NULL;
+    struct json_token t, a;
+    while (token_array_next(&entries, &entries_pos, &t)) {
+        char entry[t.len+1];
+        int entry_len = json_unescape(t.ptr, t.len, entry, t.len);
+        struct stat st, *stp = NULL;
+        if (attrs.ptr && token_array_next(&attrs, &attrs_pos, &a) &&
+            a.type == JSON_TYPE_OBJECT_END) {
+            struct response attr_obj;
+            if (response_parse(&attr_obj, (char *)a.ptr, a.len) == 0 &&
+                stat_from_response(&attr_obj, &st) == 0) {
+                stp = &st;
+            }
+        }
+        if (entry_len < 0) continue;
+        entry[entry_len] = '\0';
+
+        if (seen && !name_set_add(seen, entry)) continue;
+
+        if (strcmp(entry, ".") != 0 && strcmp(entry, "..") != 0) {
+            char entry_path[path_len + 1 + entry_len + 1];
+            sprintf(entry_path, "%s/%s", path_len == 1 ? "" : path, entry);
+            // it exists, whatever we thought before
+            if (stp) attr_cache_put(entry_path, stp, gen);
+            else attr_cache_forget_error(entry_path);
+        }
+        filler(buf, entry, stp, 0);
+    }
+    return 0;
+}
+
 static int tabfs_readdir(const char *path,
                          void *buf,
                          fuse_fill_dir_t filler,
@@ -342,69 +2950,146 @@ static int tabfs_readdir(const char *path,
                          struct fuse_file_info *fi) {
     (void)fi;
 
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
-        "op: %Q, path: %Q, offset: %lld",
-        "readdir", path, offset);
-
-    struct json_token t;
-    for (int i = 0; json_scanf_array_elem(rdata, rsize, ".entries", i, &t) > 0; i++) {
-        char entry[t.len+1];
-        memcpy(entry, t.ptr, t.len);
-        entry[t.len] = '\0';
-        filler(buf, entry, NULL, 0);
+    if (is_local(path)) return local_readdir(path, buf, filler);
+
+    struct browser *br;
+    const char *bpath;
+    int rv = browser_for(path, &br, &bpath);
+    if (rv != 0) return rv;
+
+    uint64_t gen = attr_cache_generation();
+    if (br == NULL) {
+        // merged view: everything any of them has, first one first
+        struct fan_out fo;
+        rv = fan_out(&fo, "op: %Q, path: %Q, offset: %lld", "readdir", bpath, offset);
+        if (rv != 0) return rv;
+        struct name_set seen = { NULL, 0, 0 };
+        int filled = 0;
+        rv = fo.n > 0 ? fo.rv[0] : -ENOENT;
+        for (int i = 0; i < fo.n; i++) {
+            if (fo.rv[i] != 0) continue;
+            if (readdir_fill(path, &fo.resp[i], gen, buf, filler, &seen) == 0) filled++;
+        }
+        name_set_free(&seen);
+        fan_out_free(&fo);
+        if (filled == 0) return rv != 0 ? rv : -EIO;
+
+    } else {
+        char key[strlen(bpath) + 48];
+        sprintf(key, "readdir %d %lld %s", (int)(br - browsers), (long long)offset, bpath);
+        struct response resp;
+        rv = do_exchange_shared(br, &resp, key,
+            "op: %Q, path: %Q, offset: %lld",
+            "readdir", bpath, offset);
+        if (rv != 0) return rv;
+        rv = readdir_fill(path, &resp, gen, buf, filler, NULL);
+        response_free(&resp);
+        if (rv != 0) return rv;
+    }
+    if (strcmp(path, "/") == 0) {
+        filler(buf, ".tabfs", NULL, 0);
+        filler(buf, "browsers", NULL, 0);
     }
-
-    parse_and_free_response(rdata, rsize, "");
 
     return 0;
 }
 
 static int tabfs_releasedir(const char *path, struct fuse_file_info *fi) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) return 0;
+
+    struct browser *br;
+    int rv = browser_for(path, &br, &path);
+    if (rv != 0) return rv;
+    if (br == NULL) {
+        struct fan_out fo;
+        if (fan_out(&fo, "op: %Q, path: %Q, fh: %llu", "releasedir", path, fi->fh) == 0) {
+            fan_out_free(&fo);
+        }
+        return 0;
+    }
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, fh: %llu",
         "releasedir", path, fi->fh);
 
-    parse_and_free_response(rdata, rsize, "");
+    parse_and_free_response(&resp, "");
 
     return 0;
 }
 
 static int tabfs_truncate(const char *path, off_t size) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) return -EACCES;
+    attr_cache_evict(path);
+
+    struct browser *br;
+    int rv = browser_owning(path, 0, &br, &path);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, size: %lld",
         "truncate", path, size);
 
-    parse_and_free_response(rdata, rsize, "");
+    parse_and_free_response(&resp, "");
+
+    return 0;
+}
+
+// truncate on an open file (like when you open with O_TRUNC), so the
+// extension can truncate its buffer for that file instead of
+// committing an empty file.
+static int tabfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    attr_cache_evict(path);
+
+    struct open_file *of = open_file_for(fi);
+    pthread_mutex_lock(&of->lock);
+    readahead_drop(of);
+    of->written = 1;
+    pthread_mutex_unlock(&of->lock);
+
+    struct response resp;
+    exchange_json(of->br, &resp,
+        "op: %Q, path: %Q, size: %lld, fh: %llu",
+        "truncate", path_in_browser(path), size, of->fh);
+
+    parse_and_free_response(&resp, "");
 
     return 0;
 }
 
 static int tabfs_unlink(const char *path) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) return -EACCES;
+    attr_cache_evict(path);
+
+    struct browser *br;
+    int rv = browser_owning(path, 0, &br, &path);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q",
         "unlink", path);
 
-    parse_and_free_response(rdata, rsize, "");
+    parse_and_free_response(&resp, "");
 
     return 0;
 }
 
 static int tabfs_mkdir(const char *path, mode_t mode) {
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) return -EACCES;
+    attr_cache_evict(path);
+
+    struct browser *br;
+    int rv = browser_owning(path, 1, &br, &path);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, mode: %d",
         "mkdir", path, mode);
 
-    parse_and_free_response(rdata, rsize, "");
+    parse_and_free_response(&resp, "");
 
     return 0;
 }
@@ -412,13 +3097,19 @@ static int tabfs_mkdir(const char *path, mode_t mode) {
 static int tabfs_mknod(const char *path, mode_t mode, dev_t rdev) {
     (void)rdev;
 
-    char *rdata;
-    size_t rsize;
-    exchange_json(&rdata, &rsize,
+    if (is_local(path)) return -EACCES;
+    attr_cache_evict(path);
+
+    struct browser *br;
+    int rv = browser_owning(path, 1, &br, &path);
+    if (rv != 0) return rv;
+
+    struct response resp;
+    exchange_json(br, &resp,
         "op: %Q, path: %Q, mode: %d",
         "mknod", path, mode);
 
-    parse_and_free_response(rdata, rsize, "");
+    parse_and_free_response(&resp, "");
 
     return 0;
 }
@@ -430,50 +3121,367 @@ static const struct fuse_operations tabfs_oper = {
     .open    = tabfs_open,
     .read    = tabfs_read,
     .write   = tabfs_write,
+    .flush   = tabfs_flush,
+    .fsync   = tabfs_fsync,
     .release = tabfs_release,
+#if FUSE_VERSION >= 28
+    .poll    = tabfs_poll,
+#endif
 
     .opendir    = tabfs_opendir,
     .readdir    = tabfs_readdir,
     .releasedir = tabfs_releasedir,
 
-    .truncate = tabfs_truncate,
-    .unlink   = tabfs_unlink,
+    .truncate  = tabfs_truncate,
+    .ftruncate = tabfs_ftruncate,
+    .unlink    = tabfs_unlink,
 
     .mkdir  = tabfs_mkdir,
     .mknod = tabfs_mknod,
 };
 
+// Daemon mode. A daemon (`tabfs --daemon`) owns the mount and outlives
+// the extension; when the browser starts tabfs as its native messaging
+// host and there's a daemon listening, that tabfs is just a relay
+// between the extension and the daemon's socket. So reloading the
+// extension or restarting the browser doesn't unmount anything, and
+// requests in the meantime wait for it to come back. TABFS_DAEMON=1
+// makes the browser's tabfs start a daemon if there isn't one yet.
+//
+// Any number of browsers (or profiles) can be connected to one daemon
+// at once. Each relay starts by telling the daemon its browser's name,
+// and each browser shows up as /browsers/NAME (see browser_for).
+static void daemon_socket_path(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (getenv("TABFS_SOCKET")) {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", getenv("TABFS_SOCKET"));
+    } else if (getenv("XDG_RUNTIME_DIR")) {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/tabfs.sock", getenv("XDG_RUNTIME_DIR"));
+    } else {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/tabfs-%d.sock", (int)getuid());
+    }
+}
+
+static int daemon_connect(void) {
+    struct sockaddr_un addr;
+    daemon_socket_path(&addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Starts a daemon, all on its own: in its own session, and not holding
+// on to the browser's end of our stdin and stdout.
+static void daemon_spawn(const char *self) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) _exit(0);
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(self, self, "--daemon", (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+// What to call the browser that started us: TABFS_BROWSER if it's set,
+// or else a guess from how it started us (Chrome passes our origin,
+// Firefox passes a manifest path and then our id).
+static void browser_name(char *name, size_t size, int argc, char **argv) {
+    if (getenv("TABFS_BROWSER") && getenv("TABFS_BROWSER")[0]) {
+        snprintf(name, size, "%s", getenv("TABFS_BROWSER"));
+    } else if (argc > 1 && strncmp(argv[1], "chrome-extension://", 19) == 0) {
+        snprintf(name, size, "chrome");
+    } else if (argc > 2) {
+        snprintf(name, size, "firefox");
+    } else {
+        snprintf(name, size, "browser");
+    }
+    // it's going to be a directory name
+    for (char *p = name; *p; p++) {
+        if (*p == '/') *p = '_';
+    }
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) snprintf(name, size, "browser");
+}
+
+static void *relay_copy(void *ud) {
+    int *fds = ud;
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) break;
+        struct iovec iov = { buf, (size_t)n };
+        if (writev_all(fds[1], &iov, 1) != 0) break;
+    }
+    // whichever side hung up, we're done
+    exit(0);
+    return NULL;
+}
+
+// Passes bytes between the extension (our stdin and stdout) and the
+// daemon, as is; they're both speaking the same length-prefixed JSON.
+// First, though, tells the daemon which browser it's talking to:
+//
+//   {op: "hello", name: "chrome"}
+static int relay(int sock, const char *name) {
+    char buf[256];
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    uint32_t size_4bytes = json_printf(&out, "{op: %Q, name: %Q}", "hello", name);
+    struct iovec iov[2] = {
+        { &size_4bytes, sizeof(size_4bytes) },
+        { buf, size_4bytes },
+    };
+    if (size_4bytes >= sizeof(buf) || writev_all(sock, iov, 2) != 0) return 1;
+
+    static int to_daemon[2], to_extension[2];
+    to_daemon[0] = STDIN_FILENO; to_daemon[1] = sock;
+    to_extension[0] = sock; to_extension[1] = STDOUT_FILENO;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relay_copy, to_daemon) != 0) return 1;
+    relay_copy(to_extension);
+    return 0;
+}
+
+// One of these per relay connected to the daemon: finds out which
+// browser it is, then reads from it until it hangs up.
+static void *connection_main(void *ud) {
+    int fd = (int)(intptr_t)ud;
+
+    char *data = NULL;
+    struct response resp;
+    struct json_token name;
+    ssize_t size = extension_read(fd, &data);
+    if (size < 0 || response_parse(&resp, data, size) != 0 ||
+        response_scanf(&resp, "name: %T", &name) != 1 ||
+        name.type != JSON_TYPE_STRING || name.len >= MAX_BROWSER_NAME) {
+        eprintln("daemon: warning: connection didn't say hello, hanging up");
+        msgbuf_free(data);
+        close(fd);
+        return NULL;
+    }
+    char name_buf[MAX_BROWSER_NAME];
+    int name_len = json_unescape(name.ptr, name.len, name_buf, sizeof(name_buf) - 1);
+    name_buf[name_len < 0 ? 0 : name_len] = '\0';
+    msgbuf_free(data);
+
+    struct browser *br = browser_attach(name_buf[0] ? name_buf : "browser", fd);
+    if (br == NULL) {
+        eprintln("daemon: warning: too many browsers, hanging up on %s", name_buf);
+        close(fd);
+        return NULL;
+    }
+    return reader_main(br);
+}
+
+// Takes relay connections as they come.
+static void *listener_main(void *ud) {
+    int sock = (int)(intptr_t)ud;
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(1);
+        }
+
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, connection_main, (void *)(intptr_t)fd);
+        if (err != 0) {
+            eprintln("pthread_create: %s", strerror(err));
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Whether the socket at daemon_socket_path is ours to unlink on the
+// way out (it isn't if we never got as far as binding it).
+static int daemon_bound;
+
+// Sets up the daemon's socket and mount point, without shelling out to
+// anything (no pgrep and kill: if there's a daemon, it's the one
+// holding the lock next to the socket).
+//
+// Two browsers starting at once can each fail to connect and each
+// spawn a daemon, so which one gets to be the daemon is decided by
+// flock on SOCKET.lock, held for as long as we run (and let go of by
+// the kernel when we die, however we die). Whoever has it knows any
+// socket file there is left over, and can unlink it; whoever doesn't
+// leaves the socket alone and goes away.
+static int daemon_listen(void) {
+    struct sockaddr_un addr;
+    daemon_socket_path(&addr);
+
+    char lock_path[sizeof(addr.sun_path) + sizeof(".lock")];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", addr.sun_path);
+    // (close-on-exec, so fusermount doesn't end up holding it)
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock == -1) {
+        eprintln("tabfs: can't open %s: %s", lock_path, strerror(errno));
+        exit(1);
+    }
+    if (flock(lock, LOCK_EX | LOCK_NB) == -1) {
+        eprintln("tabfs: a daemon is already running on %s", addr.sun_path);
+        exit(1);
+    }
+    // (never closed: the lock goes when we do)
+
+    int sock = daemon_connect();
+    if (sock != -1) {
+        // (one from before there were locks)
+        eprintln("tabfs: a daemon is already listening on %s", addr.sun_path);
+        exit(1);
+    }
+    unlink(addr.sun_path); // (left over from one that died)
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        eprintln("tabfs: can't listen on %s: %s", addr.sun_path, strerror(errno));
+        exit(1);
+    }
+    daemon_bound = 1;
+    if (listen(sock, 4) == -1) {
+        eprintln("tabfs: can't listen on %s: %s", addr.sun_path, strerror(errno));
+        unlink(addr.sun_path);
+        exit(1);
+    }
+    chmod(addr.sun_path, 0600);
+
+    const char *mnt = getenv("TABFS_MOUNT_DIR");
+    struct stat st;
+    if (stat(mnt, &st) == -1 && errno == ENOTCONN) {
+        // mounted by a tabfs that's gone
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        unmount(mnt, MNT_FORCE);
+#else
+        pid_t pid;
+        char *unmount_argv[] = { "fusermount", "-u", (char *)mnt, NULL };
+        if (posix_spawnp(&pid, "fusermount", NULL, NULL, unmount_argv, NULL) == 0) {
+            waitpid(pid, NULL, 0);
+        }
+#endif
+    }
+    if (mkdir(mnt, 0755) == -1 && errno != EEXIST) {
+        eprintln("tabfs: can't make %s: %s", mnt, strerror(errno));
+        exit(1);
+    }
+
+    // a relay that goes away mid-write shouldn't take us with it
+    signal(SIGPIPE, SIG_IGN);
+    return sock;
+}
+
 int main(int argc, char **argv) {
-    (void)argc;
+    daemon_mode = argc > 1 && strcmp(argv[1], "--daemon") == 0;
     if (NULL == getenv("TABFS_MOUNT_DIR")) {
         setenv("TABFS_MOUNT_DIR", "mnt", 1);
     }
 
+    if (!daemon_mode) {
+        int sock = daemon_connect();
+        if (sock == -1 && getenv("TABFS_DAEMON")) {
+            daemon_spawn(argv[0]);
+            for (int i = 0; i < 100 && sock == -1; i++) {
+                usleep(50*1000);
+                sock = daemon_connect();
+            }
+        }
+        if (sock != -1) {
+            char name[MAX_BROWSER_NAME];
+            browser_name(name, sizeof(name), argc, argv);
+            return relay(sock, name);
+        }
+    }
+
+    int listener = daemon_mode ? daemon_listen() : -1;
+
     freopen("log.txt", "a", stderr);
     setvbuf(stderr, NULL, _IONBF, 0);
 
-    char killcmd[128];
-    sprintf(killcmd, "pgrep tabfs | grep -v %d | xargs kill -9 2>/dev/null", getpid());
-    system(killcmd);
+    if (!daemon_mode) {
+        char killcmd[128];
+        sprintf(killcmd, "pgrep tabfs | grep -v %d | xargs kill -9 2>/dev/null", getpid());
+        system(killcmd);
 
 #if defined(__APPLE__)
-    system("diskutil umount force \"$TABFS_MOUNT_DIR\" >/dev/null");
+        system("diskutil umount force \"$TABFS_MOUNT_DIR\" >/dev/null");
 #elif defined(__FreeBSD__)
-    system("umount -f \"$TABFS_MOUNT_DIR\" 2>/dev/null");
+        system("umount -f \"$TABFS_MOUNT_DIR\" 2>/dev/null");
 #else
-    system("fusermount -u \"$TABFS_MOUNT_DIR\" 2>/dev/null");
+        system("fusermount -u \"$TABFS_MOUNT_DIR\" 2>/dev/null");
 #endif
 
-    system("mkdir -p \"$TABFS_MOUNT_DIR\"");
+        system("mkdir -p \"$TABFS_MOUNT_DIR\"");
+    }
+
+    if (getenv("TABFS_ATTR_TIMEOUT")) {
+        // seconds; 0 turns the attribute cache off
+        double timeout = atof(getenv("TABFS_ATTR_TIMEOUT"));
+        attr_cache_ttl_ns = timeout > 0 ? timeout * 1e9 : 0;
+    }
+    if (getenv("TABFS_NEGATIVE_TIMEOUT")) {
+        double timeout = atof(getenv("TABFS_NEGATIVE_TIMEOUT"));
+        negative_cache_ttl_ns = timeout > 0 ? timeout * 1e9 : 0;
+    }
+    if (getenv("TABFS_READAHEAD")) {
+        // most to read ahead on a file, in KiB; 0 turns it off
+        readahead_max = (size_t)atol(getenv("TABFS_READAHEAD")) * 1024;
+    }
+    if (getenv("TABFS_TIMEOUT")) {
+        // seconds to wait for the extension before giving up on a request
+        double timeout = atof(getenv("TABFS_TIMEOUT"));
+        if (timeout > 0) request_timeout_ns = timeout * 1e9;
+    }
+    if (getenv("TABFS_DENY")) {
+        deny_patterns_init(getenv("TABFS_DENY"));
+    }
+    if (getenv("TABFS_RECONNECT_WAIT")) {
+        double wait = atof(getenv("TABFS_RECONNECT_WAIT"));
+        reconnect_wait_ns = wait > 0 ? wait * 1e9 : 0;
+    }
+
+    stats_start_ns = now_ns();
 
     pthread_t thread;
-    int err = pthread_create(&thread, NULL, reader_main, NULL);
-    if (err != 0) {
-        eprintln("pthread_create: %s", strerror(err));
-        exit(1);
+    int err;
+    if (!daemon_mode) {
+        browser_name(browsers[0].name, sizeof(browsers[0].name), argc, argv);
+        err = pthread_create(&thread, NULL, reader_main, &browsers[0]);
+        if (err != 0) {
+            eprintln("pthread_create: %s", strerror(err));
+            exit(1);
+        }
+        pthread_detach(thread);
+
+    } else {
+        // nobody's connected yet; browsers show up as relays connect
+        browsers[0].in = browsers[0].out = -1;
+        browsers[0].used = browsers[0].connected = 0;
+        browsers[0].name[0] = '\0';
+        pthread_mutex_lock(&browsers_lock);
+        browsers_recount();
+        pthread_mutex_unlock(&browsers_lock);
+        err = pthread_create(&thread, NULL, listener_main, (void *)(intptr_t)listener);
+        if (err != 0) {
+            eprintln("pthread_create: %s", strerror(err));
+            exit(1);
+        }
+        pthread_detach(thread);
     }
 
-    pthread_detach(thread);
+    fuse_running = 1;
 
     char *fuse_argv[] = {
         argv[0],
@@ -481,15 +3489,27 @@ int main(int argc, char **argv) {
 #if !defined(__APPLE__)
 #if !defined(__FreeBSD__)
         "-oauto_unmount",
+        // fewer, bigger write requests
+        "-obig_writes",
+        "-omax_write=" STRINGIFY(MAX_WRITE_SIZE),
 #endif
+        // let Ctrl-C interrupt requests (see request_wait)
+        "-ointr",
 #endif
-        "-odirect_io",
+        // (no -odirect_io: tabfs_open decides, file by file)
         getenv("TABFS_MOUNT_DIR"),
         NULL,
     };
-    return fuse_main(
+    int rv = fuse_main(
         (sizeof(fuse_argv)/sizeof(*fuse_argv))-1,
         (char **)&fuse_argv,
         &tabfs_oper,
         NULL);
+    // (still holding the lock, so no new daemon has bound it since)
+    if (daemon_bound) {
+        struct sockaddr_un addr;
+        daemon_socket_path(&addr);
+        unlink(addr.sun_path);
+    }
+    return rv;
 }
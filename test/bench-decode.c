@@ -0,0 +1,130 @@
+// Benchmark for decoding read() responses in fs/tabfs.c: compares the
+// old path (json_scanf for id, again for error, again for `buf: %V`,
+// then copying into the FUSE buffer) against the one-pass response
+// parser plus each base64 decoder, on a 1 MiB payload.
+//
+// Also checks that every decoder agrees with frozen's b64dec first.
+
+#define main tabfs_main
+#include "../fs/tabfs.c"
+#undef main
+
+#include <time.h>
+
+#define PAYLOAD_SIZE (1024*1024)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *make_response(const unsigned char *payload, int n, size_t *sizep) {
+    size_t cap = n * 2 + 128;
+    char *buf = malloc(cap);
+    struct json_out out = JSON_OUT_BUF(buf, cap);
+    *sizep = json_printf(&out, "{op: %Q, buf: %V, id: %llu}",
+                         "read", payload, n, 12345ULL);
+    return buf;
+}
+
+static void check_decoders(void) {
+    base64_decoder *decoders[] = {
+        base64_decode_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_supports("ssse3") ? base64_decode_ssse3 : base64_decode_scalar,
+        __builtin_cpu_supports("avx2") ? base64_decode_avx2 : base64_decode_scalar,
+#endif
+    };
+    unsigned char payload[300];
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = rand();
+
+    for (size_t d = 0; d < sizeof(decoders)/sizeof(*decoders); d++) {
+        base64_decode_fast = decoders[d];
+        for (int n = 0; n <= (int)sizeof(payload); n++) {
+            size_t size;
+            char *msg = make_response(payload, n, &size);
+            struct response resp;
+            assert(response_parse(&resp, msg, size) == 0);
+            assert(resp.has_id && resp.id == 12345 && !resp.has_error);
+            struct json_token t;
+            assert(response_scanf(&resp, "buf: %T", &t) == 1);
+
+            char expected[sizeof(payload) + 4];
+            assert(b64dec(t.ptr, t.len, expected) == n);
+            assert(memcmp(expected, payload, n) == 0);
+
+            // every destination size, including ones that cut a group
+            char out[sizeof(payload) + 64];
+            for (int cap = 0; cap <= n + 8; cap++) {
+                memset(out, 0xAA, sizeof(out));
+                size_t len = base64_decode_into(out, cap, t.ptr, t.len);
+                assert(len == (size_t)(cap < n ? cap : n));
+                assert(memcmp(out, payload, len) == 0);
+                assert((unsigned char)out[cap] == 0xAA); // no overrun
+            }
+            free(msg);
+        }
+    }
+    base64_decode_fast = NULL;
+}
+
+int main(void) {
+    check_decoders();
+
+    unsigned char *payload = malloc(PAYLOAD_SIZE);
+    for (int i = 0; i < PAYLOAD_SIZE; i++) payload[i] = rand();
+    size_t size;
+    char *msg = make_response(payload, PAYLOAD_SIZE, &size);
+    char *dst = malloc(PAYLOAD_SIZE);
+    const int iters = 200;
+
+    printf("decoding a %d-byte read response (%zu bytes of JSON)\n\n",
+           PAYLOAD_SIZE, size);
+    printf("path\t\t\tMB/s of payload\n");
+
+    {
+        double start = now();
+        for (int i = 0; i < iters; i++) {
+            unsigned long long id; int err;
+            assert(json_scanf(msg, size, "{id: %llu}", &id) == 1);
+            assert(json_scanf(msg, size, "{error: %d}", &err) == 0);
+            char *scan_buf; int scan_len;
+            assert(json_scanf(msg, size, "{buf: %V}", &scan_buf, &scan_len) == 1);
+            memcpy(dst, scan_buf, scan_len);
+            free(scan_buf);
+        }
+        double elapsed = now() - start;
+        assert(memcmp(dst, payload, PAYLOAD_SIZE) == 0);
+        printf("frozen json_scanf x3\t%.0f\n", iters * (PAYLOAD_SIZE / 1e6) / elapsed);
+    }
+
+    struct { const char *name; base64_decoder *decoder; } decoders[] = {
+        { "one pass + scalar", base64_decode_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "one pass + ssse3", __builtin_cpu_supports("ssse3") ? base64_decode_ssse3 : NULL },
+        { "one pass + avx2", __builtin_cpu_supports("avx2") ? base64_decode_avx2 : NULL },
+#endif
+    };
+    for (size_t d = 0; d < sizeof(decoders)/sizeof(*decoders); d++) {
+        if (decoders[d].decoder == NULL) {
+            printf("%s\t(not supported on this CPU)\n", decoders[d].name);
+            continue;
+        }
+        base64_decode_fast = decoders[d].decoder;
+        memset(dst, 0, PAYLOAD_SIZE);
+
+        double start = now();
+        for (int i = 0; i < iters; i++) {
+            struct response resp;
+            assert(response_parse(&resp, msg, size) == 0);
+            struct json_token t;
+            assert(response_scanf(&resp, "buf: %T", &t) == 1);
+            assert(base64_decode_into(dst, PAYLOAD_SIZE, t.ptr, t.len) == PAYLOAD_SIZE);
+        }
+        double elapsed = now() - start;
+        assert(memcmp(dst, payload, PAYLOAD_SIZE) == 0);
+        printf("%s\t%.0f\n", decoders[d].name, iters * (PAYLOAD_SIZE / 1e6) / elapsed);
+    }
+    return 0;
+}
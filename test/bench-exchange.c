@@ -0,0 +1,233 @@
+// Microbenchmark for the request path in fs/tabfs.c: N threads call
+// tabfs_getattr in a loop (like N FUSE worker threads would) against
+// an in-process fake extension that answers every request right away.
+// No browser and no FUSE mount needed.
+//
+// Prints getattr ops/sec for each thread count, heap allocations per
+// op for a few kinds of op, then how fast a big file reads
+// sequentially with and without read-ahead.
+
+#define main tabfs_main
+#include "../fs/tabfs.c"
+#undef main
+
+#include <time.h>
+
+#ifdef __GLIBC__
+// count every heap allocation in the process, whoever makes it
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static uint64_t heap_allocs;
+void *malloc(size_t n) {
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+void *calloc(size_t n, size_t m) {
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, m);
+}
+void *realloc(void *p, size_t n) {
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+#endif
+
+static int to_tabfs[2], from_tabfs[2];
+
+// size of every file, as far as the fake extension is concerned
+#define FILE_SIZE (20*1024*1024)
+// like MAX_BUF_PER_MESSAGE in background.js
+#define MAX_BUF_PER_MESSAGE (3*256*1024)
+// a real read has to go through the browser's message loop and an
+// onMessage handler before we start sending anything back; this is a
+// (generous) stand-in for that.
+#define READ_LATENCY_US 500
+
+static void write_all(int fd, void *buf, size_t sz) {
+    struct iovec iov = { buf, sz };
+    if (writev_all(fd, &iov, 1) != 0) exit(1);
+}
+
+static void *fake_extension_main(void *ud) {
+    (void)ud;
+    char *data = malloc(MAX_MESSAGE_SIZE);
+    char *resp = malloc(2*MAX_MESSAGE_SIZE);
+    char *contents = calloc(1, MAX_MESSAGE_SIZE);
+    for (;;) {
+        uint32_t size_4bytes;
+        if (read_all(from_tabfs[0], &size_4bytes, sizeof(size_4bytes)) != 0 ||
+            read_all(from_tabfs[0], data, size_4bytes) != 0) exit(1);
+
+        unsigned long long id;
+        char op[16] = {0};
+        struct json_token op_tok;
+        int size = 0;
+        long long offset = 0;
+        assert(json_scanf(data, size_4bytes, "{id: %llu, op: %T}", &id, &op_tok) == 2);
+        memcpy(op, op_tok.ptr, op_tok.len < 15 ? op_tok.len : 15);
+        json_scanf(data, size_4bytes, "{size: %d}", &size);
+        json_scanf(data, size_4bytes, "{offset: %lld}", &offset);
+
+        struct json_out out = JSON_OUT_BUF(resp, 2*MAX_MESSAGE_SIZE);
+        uint32_t resp_size;
+        if (strcmp(op, "getattr") == 0) {
+            resp_size = json_printf(&out,
+                "{id: %llu, op: %Q, st_mode: %d, st_nlink: %d, st_size: %d}",
+                id, op, 040755, 3, 0);
+        } else if (strcmp(op, "readlink") == 0) {
+            resp_size = json_printf(&out, "{id: %llu, op: %Q, buf: %V}",
+                id, op, "../by-id/123", 12);
+        } else if (strcmp(op, "open") == 0) {
+            resp_size = json_printf(&out, "{id: %llu, op: %Q, fh: %d}", id, op, 1);
+        } else if (strcmp(op, "read") == 0) {
+            usleep(READ_LATENCY_US);
+            if (offset > FILE_SIZE) offset = FILE_SIZE;
+            if (size > FILE_SIZE - offset) size = FILE_SIZE - offset;
+            // split it up the way the extension does
+            for (; size > MAX_BUF_PER_MESSAGE; size -= MAX_BUF_PER_MESSAGE) {
+                out = (struct json_out) JSON_OUT_BUF(resp, 2*MAX_MESSAGE_SIZE);
+                resp_size = json_printf(&out, "{id: %llu, op: %Q, buf: %V, more: true}",
+                    id, op, contents, MAX_BUF_PER_MESSAGE);
+                write_all(to_tabfs[1], &resp_size, sizeof(resp_size));
+                write_all(to_tabfs[1], resp, resp_size);
+            }
+            out = (struct json_out) JSON_OUT_BUF(resp, 2*MAX_MESSAGE_SIZE);
+            resp_size = json_printf(&out, "{id: %llu, op: %Q, buf: %V}",
+                id, op, contents, size);
+        } else {
+            resp_size = json_printf(&out, "{id: %llu, op: %Q}", id, op);
+        }
+        write_all(to_tabfs[1], &resp_size, sizeof(resp_size));
+        write_all(to_tabfs[1], resp, resp_size);
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile int running;
+static unsigned long long total_ops;
+
+static void *worker_main(void *ud) {
+    (void)ud;
+    unsigned long long ops = 0;
+    struct stat st;
+    while (running) {
+        assert(tabfs_getattr("/tabs/by-id", &st) == 0);
+        assert(S_ISDIR(st.st_mode));
+        ops++;
+    }
+    __atomic_fetch_add(&total_ops, ops, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static char readbuf[MAX_MESSAGE_SIZE];
+
+static void op_getattr(void) {
+    struct stat st;
+    assert(tabfs_getattr("/tabs/by-id", &st) == 0);
+}
+static void op_readlink(void) {
+    assert(tabfs_readlink("/tabs/last-focused", readbuf, 4096) == 0);
+    assert(strcmp(readbuf, "../by-id/123") == 0);
+}
+// (both re-read the start of the file, so they never read ahead)
+static struct fuse_file_info read_fi;
+static void op_read_4k(void) {
+    assert(tabfs_read("/tabs/by-id/1/text.txt", readbuf, 4096, 4096, &read_fi) == 4096);
+}
+static void op_read_128k(void) {
+    assert(tabfs_read("/tabs/by-id/1/text.txt", readbuf, 131072, 4096, &read_fi) == 131072);
+}
+
+// like cp: the whole file, 128K at a time
+static double read_whole_file_mbps(void) {
+    struct fuse_file_info fi = {0};
+    assert(tabfs_open("/tabs/by-id/1/debugger/resources/bundle.js", &fi) == 0);
+    double start = now();
+    off_t offset = 0;
+    int n;
+    while ((n = tabfs_read("/tabs/by-id/1/debugger/resources/bundle.js",
+                           readbuf, 131072, offset, &fi)) > 0) {
+        offset += n;
+    }
+    double elapsed = now() - start;
+    assert(n == 0 && offset == FILE_SIZE);
+    assert(tabfs_release("/tabs/by-id/1/debugger/resources/bundle.js", &fi) == 0);
+    return FILE_SIZE / 1e6 / elapsed;
+}
+
+static void report_allocs(FILE *report, const char *name, void (*op)(void)) {
+    const int n = 1000;
+    for (int i = 0; i < 10; i++) op(); // warm up buffers
+    uint64_t before = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) op();
+    uint64_t after = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+    fprintf(report, "%s\t%.2f\n", name, (double)(after - before) / n);
+}
+
+int main(void) {
+    // keep the real stdout for our report; tabfs.c owns fds 0 and 1.
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+
+    // we want to measure round trips, not the attribute cache
+    attr_cache_ttl_ns = 0;
+
+    assert(pipe(to_tabfs) == 0 && pipe(from_tabfs) == 0);
+    dup2(to_tabfs[0], STDIN_FILENO);
+    dup2(from_tabfs[1], STDOUT_FILENO);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, reader_main, &browsers[0]);
+    pthread_create(&thread, NULL, fake_extension_main, NULL);
+
+    const double seconds = 1.0;
+    const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    fprintf(report, "threads\tgetattr ops/sec\n");
+    for (size_t i = 0; i < sizeof(thread_counts)/sizeof(*thread_counts); i++) {
+        int n = thread_counts[i];
+        pthread_t workers[n];
+
+        total_ops = 0;
+        running = 1;
+        double start = now();
+        for (int j = 0; j < n; j++) pthread_create(&workers[j], NULL, worker_main, NULL);
+        usleep(seconds * 1e6);
+        running = 0;
+        for (int j = 0; j < n; j++) pthread_join(workers[j], NULL);
+        double elapsed = now() - start;
+
+        fprintf(report, "%d\t%.0f\n", n, total_ops / elapsed);
+        fflush(report);
+    }
+
+    assert(tabfs_open("/tabs/by-id/1/text.txt", &read_fi) == 0);
+#ifdef __GLIBC__
+    // (includes the fake extension's own allocations, which are none
+    // in steady state)
+    fprintf(report, "\nop\tallocs/op\n");
+    report_allocs(report, "getattr", op_getattr);
+    report_allocs(report, "readlink", op_readlink);
+    report_allocs(report, "read 4K", op_read_4k);
+    report_allocs(report, "read 128K", op_read_128k);
+#else
+    (void)report_allocs;
+#endif
+
+    fprintf(report, "\nread-ahead\tMB/s reading a %d MB file\n", FILE_SIZE >> 20);
+    const size_t readaheads[] = {0, 1024*1024, 4*1024*1024, 16*1024*1024};
+    for (size_t i = 0; i < sizeof(readaheads)/sizeof(*readaheads); i++) {
+        readahead_max = readaheads[i];
+        double mbps = 0;
+        for (int j = 0; j < 3; j++) mbps += read_whole_file_mbps() / 3;
+        if (readahead_max == 0) fprintf(report, "off\t\t%.0f\n", mbps);
+        else fprintf(report, "%zuK\t\t%.0f\n", readahead_max >> 10, mbps);
+        fflush(report);
+    }
+    return 0;
+}
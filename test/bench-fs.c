@@ -0,0 +1,166 @@
+// Benchmark for a mounted tabfs, end to end: FUSE, fs/tabfs.c, the
+// native messaging pipe, and whatever's on the other end of it. Meant
+// to run against fake-browser.js (`make run-bench-fs`), so it needs
+// FUSE but no browser.
+//
+// ./bench-fs MOUNT_DIR
+//
+// For each kind of op and each number of threads, every thread does
+// the op in a loop for a second; prints ops/sec and p50/p99 latency.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static const char *mnt;
+static int tab_ids[1024];
+static int num_tabs;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void tab_path(char *buf, size_t size, int i, const char *file) {
+    snprintf(buf, size, "%s/tabs/by-id/%d/%s", mnt, tab_ids[i % num_tabs], file);
+}
+
+static void op_getattr(int i) {
+    char path[4096];
+    struct stat st;
+    tab_path(path, sizeof(path), i, "title.txt");
+    assert(stat(path, &st) == 0);
+}
+static void op_readdir(int i) {
+    (void)i;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tabs/by-id", mnt);
+    DIR *dir = opendir(path);
+    assert(dir != NULL);
+    int n = 0;
+    while (readdir(dir)) n++;
+    assert(n >= num_tabs);
+    closedir(dir);
+}
+static void op_read(int i) {
+    char path[4096], buf[65536];
+    tab_path(path, sizeof(path), i, "text.txt");
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    while (read(fd, buf, sizeof(buf)) > 0);
+    close(fd);
+}
+static void op_write(int i) {
+    char path[4096], buf[64];
+    tab_path(path, sizeof(path), i, "url.txt");
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    assert(fd >= 0);
+    int n = snprintf(buf, sizeof(buf), "https://example.com/%d\n", i);
+    assert(write(fd, buf, n) == n);
+    assert(close(fd) == 0);
+}
+
+static const struct { const char *name; void (*op)(int i); } ops[] = {
+    { "getattr", op_getattr },
+    { "readdir", op_readdir },
+    { "read", op_read },
+    { "write", op_write },
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    void (*op)(int i);
+    uint64_t *latencies;
+    size_t n, cap;
+};
+static volatile int running;
+
+static void *worker_main(void *ud) {
+    struct worker *w = ud;
+    for (int i = w->index; running; i += 64) {
+        uint64_t start = now_ns();
+        w->op(i);
+        if (w->n == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 1024;
+            w->latencies = realloc(w->latencies, w->cap * sizeof(*w->latencies));
+        }
+        w->latencies[w->n++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s MOUNT_DIR\n", argv[0]);
+        return 2;
+    }
+    mnt = argv[1];
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tabs/by-id", mnt);
+    DIR *dir = opendir(path);
+    assert(dir != NULL);
+    struct dirent *de;
+    while ((de = readdir(dir)) && num_tabs < 1024) {
+        if (de->d_name[0] != '.') tab_ids[num_tabs++] = atoi(de->d_name);
+    }
+    closedir(dir);
+    assert(num_tabs > 0);
+
+    const double seconds = 1.0;
+    const int thread_counts[] = {1, 2, 4, 8, 16};
+    printf("op\tthreads\tops/sec\tp50_us\tp99_us\n");
+    for (size_t o = 0; o < sizeof(ops)/sizeof(*ops); o++) {
+        for (size_t t = 0; t < sizeof(thread_counts)/sizeof(*thread_counts); t++) {
+            int n = thread_counts[t];
+            struct worker workers[n];
+            memset(workers, 0, sizeof(workers));
+
+            running = 1;
+            uint64_t start = now_ns();
+            for (int j = 0; j < n; j++) {
+                workers[j].index = j;
+                workers[j].op = ops[o].op;
+                pthread_create(&workers[j].thread, NULL, worker_main, &workers[j]);
+            }
+            usleep(seconds * 1e6);
+            running = 0;
+            size_t total = 0;
+            for (int j = 0; j < n; j++) {
+                pthread_join(workers[j].thread, NULL);
+                total += workers[j].n;
+            }
+            double elapsed = (now_ns() - start) / 1e9;
+
+            uint64_t *all = malloc((total + 1) * sizeof(*all));
+            size_t k = 0;
+            for (int j = 0; j < n; j++) {
+                memcpy(all + k, workers[j].latencies, workers[j].n * sizeof(*all));
+                k += workers[j].n;
+                free(workers[j].latencies);
+            }
+            qsort(all, total, sizeof(*all), compare_u64);
+            printf("%s\t%d\t%.0f\t%.0f\t%.0f\n", ops[o].name, n, total / elapsed,
+                   total ? all[total / 2] / 1e3 : 0,
+                   total ? all[total * 99 / 100] / 1e3 : 0);
+            fflush(stdout);
+            free(all);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+// A fake browser for running tabfs without one: loads
+// extension/background.js under node with a made-up `browser` API
+// (some tabs in some windows, with a bit of text each), starts tabfs
+// the way the browser would, as a native messaging host talking
+// length-prefixed JSON over its stdin/stdout, and answers its requests
+// with the real Routes.
+//
+// node fake-browser.js [options] [-- command args...]
+//
+//   --tabs=N            how many tabs (default 20)
+//   --windows=N         spread over how many windows (default 2)
+//   --text-size=BYTES   size of each tab's text.txt/body.html (default 4096)
+//   --latency=MS        delay every browser API call this long (default 0)
+//   --latency-API=MS    ...or just this one, like --latency-tabs.executeScript=20
+//   --host=PATH         native messaging host to run (default ../fs/tabfs)
+//   --mount=DIR         where it should mount (default ../fs/mnt)
+//   --verbose           keep background.js's console.log
+//
+// With a command, waits for the mount, runs the command, then shuts
+// everything down and exits with the command's status. Without one,
+// runs until you kill it (or tabfs exits).
+
+const path = require('path');
+const fs = require('fs');
+const { spawn, spawnSync } = require('child_process');
+
+const opts = { tabs: 20, windows: 2, 'text-size': 4096, latency: 0,
+               host: path.join(__dirname, '../fs/tabfs'),
+               mount: path.join(__dirname, '../fs/mnt') };
+const latencies = {};
+let command = null;
+for (let i = 2; i < process.argv.length; i++) {
+  const arg = process.argv[i];
+  if (arg === '--') { command = process.argv.slice(i + 1); break; }
+  const m = arg.match(/^--([^=]+)(?:=(.*))?$/);
+  if (!m) { console.error('bad argument', arg); process.exit(2); }
+  const [, key, value = true] = m;
+  if (key.startsWith('latency-')) { latencies[key.substr('latency-'.length)] = +value; }
+  else if (key === 'host' || key === 'mount') { opts[key] = path.resolve(value); }
+  else { opts[key] = typeof value === 'string' && !isNaN(value) ? +value : value; }
+}
+
+const sleep = ms => new Promise(resolve => setTimeout(resolve, ms));
+// wraps a fake API function so it takes as long as we were told
+function api(name, fn) {
+  return async (...args) => {
+    const ms = latencies[name] !== undefined ? latencies[name] : opts.latency;
+    if (ms > 0) { await sleep(ms); }
+    return fn(...args);
+  };
+}
+function event() {
+  const listeners = [];
+  return { addListener(fn) { listeners.push(fn); },
+           fire(...args) { listeners.forEach(fn => fn(...args)); } };
+}
+
+// the browser's state
+const windows = [];
+for (let i = 0; i < opts.windows; i++) { windows.push({ id: 1000 + i, focused: i === 0 }); }
+const tabs = [];
+for (let i = 0; i < opts.tabs; i++) {
+  const windowId = windows[i % windows.length].id;
+  tabs.push({ id: 1 + i, windowId, index: Math.floor(i / windows.length),
+              active: i < windows.length, url: `https://example.com/${i + 1}`,
+              title: `Example page ${i + 1}` });
+}
+let nextTabId = tabs.length + 1;
+const pageText = 'x'.repeat(opts['text-size']);
+const tabById = tabId => {
+  const tab = tabs.find(tab => tab.id === tabId);
+  if (!tab) { throw new Error(`No tab with id: ${tabId}.`); }
+  return tab;
+};
+
+const tabEvents = { onCreated: event(), onUpdated: event(), onRemoved: event(),
+                    onActivated: event(), onMoved: event(),
+                    onAttached: event(), onDetached: event() };
+const windowEvents = { onCreated: event(), onRemoved: event(), onFocusChanged: event() };
+const runtimeEvents = { onConnect: event() };
+
+// content scripts: background.js injects one agent per tab, which
+// connects back over a port. We run it for real, against a pretend
+// document, in a pretend window that lasts until the tab navigates
+// (which also disconnects its ports, like leaving a page does).
+const pages = new Map(); // tabId -> {window, ports}
+function page(tab) {
+  if (!pages.has(tab.id)) {
+    const document = {
+      get title() { return tab.title; },
+      body: { innerText: pageText, innerHTML: pageText },
+      querySelectorAll: () => [],
+      getElementById: () => null,
+    };
+    pages.set(tab.id, { window: { document }, ports: [] });
+  }
+  return pages.get(tab.id);
+}
+function leavePage(tabId) {
+  const p = pages.get(tabId);
+  if (!p) { return; }
+  pages.delete(tabId);
+  p.ports.forEach(port => port.onDisconnect.fire());
+}
+// a connected pair of ports (messages go over as JSON, later)
+function connect(tab, name) {
+  const ends = [0, 1].map(() => ({ name, onMessage: event(), onDisconnect: event() }));
+  ends.forEach((end, i) => {
+    const other = ends[1 - i];
+    end.postMessage = message => {
+      const json = JSON.stringify(message);
+      setImmediate(() => other.onMessage.fire(JSON.parse(json)));
+    };
+    end.disconnect = () => other.onDisconnect.fire();
+  });
+  ends[1].sender = { tab: { ...tab } };
+  page(tab).ports.push(ends[1]);
+  setImmediate(() => runtimeEvents.onConnect.fire(ends[1]));
+  return ends[0];
+}
+function runContentScript(tab, code) {
+  const { window } = page(tab);
+  const chrome = { runtime: { connect: ({ name } = {}) => connect(tab, name) } };
+  return new Function('window', 'document', 'chrome', `return eval(${JSON.stringify(code)})`)(
+    window, window.document, chrome);
+}
+
+global.window = global;
+global.chrome = {};
+// (background.js base64s read() results with one of these)
+global.FileReader = class {
+  readAsDataURL(blob) {
+    blob.arrayBuffer().then(buf => {
+      this.result = 'data:application/octet-stream;base64,' + Buffer.from(buf).toString('base64');
+      this.onload();
+    });
+  }
+};
+global.browser = {
+  tabs: {
+    ...tabEvents,
+    get: api('tabs.get', tabId => ({ ...tabById(tabId) })),
+    query: api('tabs.query', (query = {}) => tabs
+      .filter(tab => (query.windowId === undefined || tab.windowId === query.windowId) &&
+                     (query.active === undefined || tab.active === query.active) &&
+                     (!query.lastFocusedWindow ||
+                      tab.windowId === windows.find(w => w.focused).id))
+      .map(tab => ({ ...tab }))),
+    update: api('tabs.update', (tabId, props) => {
+      const tab = tabById(tabId);
+      if (props.active && !tab.active) {
+        tabs.forEach(t => { if (t.windowId === tab.windowId) { t.active = false; } });
+        tabEvents.onActivated.fire({ tabId, windowId: tab.windowId });
+      }
+      if (props.url !== undefined && props.url !== tab.url) { leavePage(tabId); }
+      Object.assign(tab, props);
+      tabEvents.onUpdated.fire(tabId, props, { ...tab });
+      return { ...tab };
+    }),
+    create: api('tabs.create', ({ url = 'about:blank', windowId = windows[0].id } = {}) => {
+      const tab = { id: nextTabId++, windowId, index: tabs.length, active: false,
+                    url, title: url };
+      tabs.push(tab);
+      tabEvents.onCreated.fire({ ...tab });
+      return { ...tab };
+    }),
+    remove: api('tabs.remove', tabId => {
+      const tab = tabById(tabId);
+      tabs.splice(tabs.indexOf(tab), 1);
+      leavePage(tabId);
+      tabEvents.onRemoved.fire(tabId, { windowId: tab.windowId });
+    }),
+    // every page is the same page, as far as scripts are concerned
+    executeScript: api('tabs.executeScript', (tabId, { code }) => {
+      const tab = tabById(tabId);
+      if (code.includes("'tabfs-agent'")) { return [runContentScript(tab, code)]; }
+      if (code.includes('innerText') || code.includes('innerHTML')) { return [pageText]; }
+      return [null];
+    }),
+    captureVisibleTab: api('tabs.captureVisibleTab', () =>
+      'data:image/png;base64,' + Buffer.from(pageText).toString('base64')),
+  },
+  windows: {
+    ...windowEvents,
+    getAll: api('windows.getAll', () => windows.map(w => ({ ...w }))),
+    get: api('windows.get', windowId => ({ ...windows.find(w => w.id === windowId) })),
+    getLastFocused: api('windows.getLastFocused', () => ({ ...windows.find(w => w.focused) })),
+    update: api('windows.update', (windowId, props) => {
+      if (props.focused) { windows.forEach(w => { w.focused = w.id === windowId; }); }
+      windowEvents.onFocusChanged.fire(windowId);
+    }),
+  },
+  management: {
+    getAll: api('management.getAll', () => []),
+    get: api('management.get', () => { throw new Error('no such extension'); }),
+  },
+  runtime: { ...runtimeEvents, reload() {} },
+};
+
+if (!opts.verbose) { console.log = () => {}; }
+const { tryConnect, listenForInvalidations } = require('../extension/background');
+
+// what chrome.runtime.connectNative does: run the host, and frame
+// messages to and from it
+let host;
+chrome.runtime = {
+  getURL: p => 'chrome-extension://fake' + p,
+  connectNative() {
+    host = spawn(opts.host, [], {
+      cwd: path.dirname(opts.host),
+      env: { ...process.env, TABFS_MOUNT_DIR: opts.mount },
+      stdio: ['pipe', 'pipe', 'inherit'],
+    });
+    const onMessage = event(), onDisconnect = event();
+    let pending = Buffer.alloc(0);
+    host.stdout.on('data', data => {
+      pending = Buffer.concat([pending, data]);
+      while (pending.length >= 4) {
+        const size = pending.readUInt32LE(0);
+        if (pending.length < 4 + size) { break; }
+        const message = JSON.parse(pending.toString('utf8', 4, 4 + size));
+        pending = pending.subarray(4 + size);
+        onMessage.fire(message);
+      }
+    });
+    host.on('exit', status => {
+      onDisconnect.fire();
+      // nothing else for us to do
+      if (!command) { process.exit(status === null ? 1 : status); }
+    });
+    return {
+      onMessage, onDisconnect,
+      postMessage(message) {
+        const json = Buffer.from(JSON.stringify(message));
+        const size = Buffer.alloc(4);
+        size.writeUInt32LE(json.length);
+        host.stdin.write(Buffer.concat([size, json]));
+      },
+    };
+  },
+};
+tryConnect();
+listenForInvalidations();
+
+function shutDown(status) {
+  if (host) { host.kill('SIGKILL'); }
+  spawnSync('fusermount', ['-u', opts.mount], { stdio: 'ignore' });
+  spawnSync('umount', ['-f', opts.mount], { stdio: 'ignore' });
+  process.exit(status);
+}
+process.on('SIGINT', () => shutDown(130));
+process.on('SIGTERM', () => shutDown(143));
+
+if (command) {
+  (async () => {
+    for (let waited = 0; !fs.existsSync(path.join(opts.mount, 'tabs')); waited += 50) {
+      if (waited > 10000) { console.error('fake-browser: tabfs never mounted'); shutDown(1); }
+      await sleep(50);
+    }
+    const child = spawn(command[0], command.slice(1), { stdio: 'inherit' });
+    child.on('exit', status => shutDown(status === null ? 1 : status));
+  })();
+}
@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <assert.h>
 #include <wordexp.h>
 #include <regex.h>
@@ -36,7 +38,7 @@ int main() {
     // reload the extension so we know it's the latest code.
     system("echo reload > ../fs/mnt/runtime/reload 2>/dev/null"); // this may error, but it should still have effect
     // spin until the extension reloads.
-    struct stat st; while (stat("../fs/mnt/tabs", &st) != 0) {}
+    struct stat st; while (stat("../fs/mnt/tabs", &st) != 0) { usleep(10000); }
 
     assert(file_contents_equal(expand("../fs/mnt/extensions/TabFS*/enabled"), "true"));
 
@@ -86,6 +88,21 @@ int main() {
         assert(system("echo remove > ../fs/mnt/tabs/last-focused/control") == 0);
     }
 
+    {
+        // poll() wakes up when the URL changes, instead of us rereading
+        // it in a loop
+        assert(system("echo about:blank > ../fs/mnt/tabs/create") == 0);
+        int fd = open("../fs/mnt/tabs/last-focused/url.txt", O_RDONLY);
+        assert(fd >= 0);
+        char url[256]; read(fd, url, sizeof(url));
+        assert(system("echo file://$(pwd)/test-resources/test-page.html > ../fs/mnt/tabs/last-focused/url.txt") == 0);
+        struct pollfd pfd = { fd, POLLPRI, 0 };
+        assert(poll(&pfd, 1, 5000) == 1 && (pfd.revents & POLLPRI));
+        close(fd);
+
+        assert(system("echo remove > ../fs/mnt/tabs/last-focused/control") == 0);
+    }
+
     {
         assert(system("echo file://$(pwd)/test-resources/test-textarea.html > ../fs/mnt/tabs/create") == 0);
         {
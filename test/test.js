@@ -3,8 +3,27 @@ const assert = require('assert');
 // mock chrome namespace
 global.window = global;
 global.chrome = {};
+// ...with just enough of a debugger to see what gets asked of it
+const debuggerCalls = [], debuggerListeners = [], detachListeners = [];
+const frameTree = {
+  frame: {id: 'top', loaderId: 'L1'}, resources: [{url: 'https://a/x.css'}],
+  childFrames: [{frame: {id: 'kid', loaderId: 'L2', parentId: 'top'}, resources: [{url: 'https://b/y.js'}]}]
+};
+chrome.debugger = {
+  onEvent: { addListener(fn) { debuggerListeners.push(fn); } },
+  onDetach: { addListener(fn) { detachListeners.push(fn); } },
+  attach(target, version, cb) { debuggerCalls.push('attach'); cb(); },
+  detach(target, cb) { debuggerCalls.push('detach'); cb(); },
+  sendCommand(target, method, params, cb) {
+    debuggerCalls.push(method);
+    if (method === 'Page.getResourceTree') { cb({frameTree}); }
+    else if (method === 'Page.getResourceContent') { cb({content: params.frameId + ' ' + params.url}); }
+    else { cb({}); }
+  }
+};
 // run background.js
-const {Routes, tryMatchRoute} = require('../extension/background');
+const {Routes, tryMatchRoute, tryConnect, TabIndex, makeRouteWithContents,
+       jsonLinesForAllTabs, Agents, TabEvents} = require('../extension/background');
 
 function readdir(path) {
   return Routes['/tabs/by-id/#TAB_ID'].readdir({path});
@@ -15,14 +34,219 @@ function readdir(path) {
   assert(['.', '..', 'url.txt', 'title.txt', 'text.txt']
     .every(file => tabReaddir.entries.includes(file)));
 
-  assert.deepEqual(await Routes['/'].readdir(),
-                   { entries: ['.', '..', 'windows', 'extensions', 'tabs', 'runtime'] });
-  assert.deepEqual(await Routes['/tabs'].readdir(),
-                   { entries: ['.', '..', 'create',
-                               'by-title', 'last-focused', 'by-id'] });
+  assert.deepEqual((await Routes['/'].readdir()).entries,
+                   ['.', '..', 'tabs', 'windows', 'extensions', 'runtime']);
+  assert.deepEqual((await Routes['/tabs'].readdir()).entries,
+                   ['.', '..', 'create', 'by-title', 'by-window',
+                    'last-focused', 'by-id', 'all']);
 
   assert.deepEqual(tryMatchRoute('/'), [Routes['/'], {}]);
 
   assert.deepEqual(tryMatchRoute('/tabs/by-id/10/url.txt'),
                    [Routes['/tabs/by-id/#TAB_ID/url.txt'], {tabId: 10}]);
+  assert.deepEqual(tryMatchRoute('/tabs/by-title/a.b.12'),
+                   [Routes['/tabs/by-title/:TAB_TITLE.#TAB_ID'], {tabTitle: 'a.b', tabId: 12}]);
+
+  // routes added at runtime get matched, and show up in their parent
+  Routes['/tabs/by-id/#TAB_ID/test/hello.txt'] = { read() { return {buf: 'hi'}; } };
+  assert.deepEqual(tryMatchRoute('/tabs/by-id/3/test/hello.txt'),
+                   [Routes['/tabs/by-id/#TAB_ID/test/hello.txt'], {tabId: 3}]);
+  assert((await readdir('/tabs/by-id/#TAB_ID')).entries.includes('test'));
+
+  // tab listings come from the index, which follows events after
+  // loading once
+  const event = () => {
+    const listeners = [];
+    return { addListener(fn) { listeners.push(fn); }, fire(...args) { listeners.forEach(fn => fn(...args)); } };
+  };
+  let calls = 0;
+  const tabs = [{id: 1, windowId: 7, index: 0, active: true, title: 'a/b'},
+                {id: 2, windowId: 7, index: 1, active: false, title: 'c'}];
+  global.browser = {
+    tabs: { onCreated: event(), onUpdated: event(), onRemoved: event(), onActivated: event(),
+            onMoved: event(), onAttached: event(), onDetached: event(),
+            async query() { calls++; return tabs.map(tab => ({...tab})); } },
+    windows: { onCreated: event(), onRemoved: event(), onFocusChanged: event(),
+               async getAll() { calls++; return [{id: 7, focused: true}]; },
+               async getLastFocused() { calls++; return {id: 7}; } }
+  };
+  TabIndex.listen();
+  assert.deepEqual((await Routes['/tabs/by-title'].readdir()).entries, ['.', '..', 'a_b.1', 'c.2']);
+  browser.tabs.onUpdated.fire(2, {title: 'd'}, {...tabs[1], title: 'd'});
+  browser.tabs.onRemoved.fire(1, {windowId: 7});
+  browser.tabs.onActivated.fire({tabId: 2, windowId: 7});
+  const callsBefore = calls;
+  assert.deepEqual((await Routes['/windows/#WINDOW_ID/tabs'].readdir({windowId: 7})).entries,
+                   ['.', '..', 'd.2']);
+  assert.deepEqual(await Routes['/tabs/last-focused'].readlink(), {buf: 'by-id/2'});
+  assert.equal(calls, callsBefore);
+
+  // readlinks go back to tabfs the same way reads do
+  console.log = () => {};
+  const toTabfs = [];
+  let fromTabfs;
+  chrome.runtime = {
+    getURL: p => 'chrome-extension://test' + p,
+    connectNative: () => ({ onMessage: { addListener(fn) { fromTabfs = fn; } },
+                            onDisconnect: { addListener() {} },
+                            postMessage(message) { toTabfs.push(message); } })
+  };
+  tryConnect();
+  await fromTabfs({id: 1, op: 'readlink', path: '/windows/last-focused'});
+  assert.equal(toTabfs[0].error, undefined);
+  assert.equal(Buffer.from(toTabfs[0].buf, 'base64').toString(), '7');
+
+  // open files share contents until one writes, and let go of them
+  // past the byte budget (getting them from getData again if read)
+  const {Cache} = makeRouteWithContents;
+  let gets = 0, contents = 'hello';
+  const route = makeRouteWithContents(() => { gets++; return contents; },
+                                      (req, buf) => { contents = buf; });
+  const path = '/test.txt';
+  const {fh: a} = await route.open({path}), {fh: b} = await route.open({path});
+  assert.equal(gets, 1);
+  assert.equal(Cache.bytes, 5);
+  await route.write({path, fh: a, offset: 0, buf: 'J'});
+  assert.equal(Cache.bytes, 10);
+  assert.equal(Buffer.from((await route.read({path, fh: b, offset: 0, size: 5})).buf).toString(), 'hello');
+  Cache.budget = 5;
+  Cache.evict();
+  assert.equal(Cache.bytes, 5); // (a's dirty, so it stays)
+  await route.release({path, fh: a});
+  assert.equal(contents, 'Jello');
+  assert.equal(Buffer.from((await route.read({path, fh: b, offset: 0, size: 5})).buf).toString(), 'Jello');
+  assert.equal(Cache.toJSON().reloads, 1);
+  await route.release({path, fh: b});
+  assert.equal(Cache.store.size, 0);
+  assert.equal(Cache.bytes, 0);
+  assert.equal(Cache.byPath.size, 0);
+
+  // when the browser says a file changed, open handles get the new
+  // contents once they read from the top again (and not halfway)
+  contents = 'one';
+  const {fh: c} = await route.open({path: '/test2.txt'});
+  contents = 'two';
+  makeRouteWithContents.ContentCache.invalidateTree('/test2.txt');
+  Cache.invalidateTree('/');
+  assert.equal(Buffer.from((await route.read({path: '/test2.txt', fh: c, offset: 1, size: 5})).buf).toString(), 'ne');
+  assert.equal(Buffer.from((await route.read({path: '/test2.txt', fh: c, offset: 0, size: 5})).buf).toString(), 'two');
+  await route.release({path: '/test2.txt', fh: c});
+
+  // a handle from before the extension reloaded isn't anybody's now,
+  // and doesn't get quietly rebuilt (it might've had writes)
+  const {fh: old} = await route.open({path: '/test5.txt'});
+  await route.write({path: '/test5.txt', fh: old, offset: 0, buf: 'lost'});
+  Cache.removeObjectForHandle(old); // (as if we'd just started)
+  await assert.rejects(route.read({path: '/test5.txt', fh: old, offset: 0, size: 5}), {error: 116});
+  await assert.rejects(route.flush({path: '/test5.txt', fh: old}), {error: 116});
+  assert(old > 2 ** 21);
+
+  // files with a version say so when they're opened, so tabfs can let
+  // the kernel cache them
+  const versioned = makeRouteWithContents(() => 'same', null, {version: () => 7});
+  const opened = await versioned.open({path: '/test3.txt'});
+  assert.deepEqual([opened.cache, opened.version], [true, '7']);
+  await versioned.release({path: '/test3.txt', fh: opened.fh});
+  const unversioned = await route.open({path: '/test4.txt'});
+  assert.equal(unversioned.cache, undefined);
+  await route.release({path: '/test4.txt', fh: unversioned.fh});
+
+  // /tabs/all runs on every tab, a few at a time, and a tab that
+  // hangs just gets an error line
+  for (let id = 3; id <= 6; id++) {
+    browser.tabs.onCreated.fire({id, windowId: 7, index: id - 2, active: false, title: 't' + id});
+  }
+  let running = 0, maxRunning = 0;
+  const jsonl = await jsonLinesForAllTabs('v', async tab => {
+    running++; maxRunning = Math.max(maxRunning, running);
+    if (tab.id === 4) { return new Promise(() => {}); }
+    await new Promise(resolve => setTimeout(resolve, 5));
+    running--;
+    return tab.title;
+  }, {concurrency: 2, timeout: 50, total: 1000});
+  assert.deepEqual(jsonl.trim().split('\n').map(JSON.parse),
+                   [{id: 2, v: 'd'}, {id: 3, v: 't3'}, {id: 4, error: 'ETIMEDOUT'},
+                    {id: 5, v: 't5'}, {id: 6, v: 't6'}]);
+  assert.equal(maxRunning, 2);
+
+  // debugger/ attaches once and keeps going, gets the resource tree
+  // once (child frames and all), then follows events
+  chrome.runtime = {};
+  const resources = Routes['/tabs/by-id/#TAB_ID/debugger/resources'];
+  const resource = Routes['/tabs/by-id/#TAB_ID/debugger/resources/:SUFFIX'];
+  const names = async () => (await resources.readdir({tabId: 9})).entries.slice(2);
+  const [css, js] = await names();
+  assert.deepEqual(await names(), [css, js]);
+  for (let i = 0; i < 2; i++) {
+    const path = '/tabs/by-id/9/debugger/resources/' + js;
+    assert.equal((await resource.getattr({path, tabId: 9, suffix: js})).st_size, 'kid https://b/y.js'.length);
+    makeRouteWithContents.ContentCache.invalidateTree(path);
+  }
+  assert.deepEqual(debuggerCalls, ['attach', 'Page.enable', 'Network.enable',
+                                   'Page.getResourceTree', 'Page.getResourceContent']);
+  const fire = (method, params) => debuggerListeners.forEach(fn => fn({tabId: 9}, method, params));
+  fire('Network.responseReceived', {frameId: 'top', loaderId: 'L1', type: 'Image',
+                                    response: {url: 'https://a/z.png'}});
+  fire('Page.frameNavigated', {frame: {id: 'kid', loaderId: 'L3', parentId: 'top'}});
+  assert.equal((await names()).length, 2);
+  assert(!(await names()).includes(js));
+  assert.equal(debuggerCalls.filter(call => call === 'Page.getResourceTree').length, 1);
+  // (and lets go when the debugger goes away)
+  detachListeners.forEach(fn => fn({tabId: 9}, 'canceled_by_user'));
+  await names();
+  assert.equal(debuggerCalls.filter(call => call === 'attach').length, 2);
+  detachListeners.forEach(fn => fn({tabId: 9}, 'target_closed'));
+
+  // a tab's agent gets injected once; calls in the same tick go over
+  // together, and big strings come back in pieces
+  const onConnect = event(), sent = [];
+  let injected = 0, agentPort;
+  browser.runtime = { onConnect };
+  browser.tabs.executeScript = async (tabId, {code}) => {
+    injected++;
+    const document = { body: { innerText: 'y'.repeat(600 * 1024), innerHTML: '<p>' } };
+    const port = agentPort = { name: 'tabfs-agent', onMessage: event(), onDisconnect: event(), sender: {tab: {id: tabId}} };
+    const agentChrome = { runtime: { connect: () => ({
+      postMessage(message) { if (!port.gone) { port.onMessage.fire(JSON.parse(JSON.stringify(message))); } },
+      onMessage: { addListener(fn) { port.postMessage = message => { sent.push(message); fn(message); }; } }
+    }) } };
+    new Function('window', 'document', 'chrome', code)({}, document, agentChrome);
+    onConnect.fire(port);
+    return [null];
+  };
+  Agents.listen();
+  const [text, html] = await Promise.all([Agents.call(5, 'text'), Agents.call(5, 'html')]);
+  assert.equal(text.length, 600 * 1024);
+  assert.equal(html, '<p>');
+  assert.equal(await Agents.call(5, 'eval', {code: '2 + 2'}), 4);
+  assert.equal(injected, 1);
+  assert.deepEqual(sent.map(message => message.calls.length), [2, 1]);
+  // a value that can't be sent back is an error, not a hang
+  await assert.rejects(Agents.call(5, 'eval', {code: 'const o = {}; o.o = o; o'}));
+
+  // a navigation in the middle of a call takes the agent with it:
+  // reads go again on a new one, evals don't
+  agentPort.gone = true;
+  const reread = Agents.call(5, 'html'), evaled = Agents.call(5, 'eval', {code: '1'});
+  await new Promise(resolve => setTimeout(resolve, 0));
+  agentPort.onDisconnect.fire();
+  assert.equal(await reread, '<p>');
+  await assert.rejects(evaled, /page went away/);
+  assert.equal(injected, 2);
+
+  // a tab's events get logged only while someone's following them, and
+  // once the tab is gone, reading to the end is the end of the file
+  const events = Routes['/tabs/by-id/#TAB_ID/events.jsonl'];
+  TabEvents.listen();
+  browser.tabs.onUpdated.fire(4, {title: 'unseen'}, {id: 4, windowId: 7, title: 'unseen'});
+  events.open({tabId: 4});
+  assert.deepEqual(events.read({tabId: 4, offset: 0, size: 4096}), {buf: ''});
+  browser.tabs.onUpdated.fire(4, {title: 'seen'}, {id: 4, windowId: 7, title: 'seen'});
+  browser.tabs.onRemoved.fire(4, {windowId: 7});
+  const lines = events.read({tabId: 4, offset: 0, size: 4096}).buf.trim().split('\n').map(JSON.parse);
+  assert.deepEqual(lines.map(line => [line.event, line.title]), [['updated', 'seen'], ['removed', undefined]]);
+  const end = Buffer.byteLength(lines.map(JSON.stringify).join('\n') + '\n');
+  assert.deepEqual(events.read({tabId: 4, offset: end, size: 4096}), {buf: '', eof: true});
+  events.release({tabId: 4});
+  assert.deepEqual(events.read({tabId: 4, offset: 0, size: 4096}), {buf: '', eof: true});
 })();